@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "message_slot.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -7,9 +8,11 @@
 #include <stddef.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <time.h>
 
 static char* DEV0 = "/dev/test0";
 static char* DEV1 = "/dev/test1";
+static char* CONTROL = "/dev/" CONTROL_DEVICE_NAME;
 
 void test1();
 void test2();
@@ -25,6 +28,15 @@ void test11();
 void test12();
 void test13();
 void test14();
+void test15();
+void test16();
+void test17();
+void test18();
+void test19();
+void test20();
+void test21();
+void test22();
+void splice_new_messages(int fd, int test_num);
 void print_failure(int test_num);
 void print_success(int test_num);
 
@@ -45,6 +57,14 @@ int main(void)
 	test12();
 	test13();
 	test14();
+	test15();
+	test16();
+	test17();
+	test18();
+	test19();
+	test20();
+	test21();
+	test22();
 
 	printf("DONE!\n");
 
@@ -431,6 +451,408 @@ void test14()
 	print_success(14);
 }
 
+void test15()
+{
+	int device0_fd;
+	int pipe_fds[2];
+	loff_t offset = 0;
+	char msg[128];
+
+	device0_fd = open(DEV0, O_RDWR);
+	if (device0_fd < 0)
+	{ print_failure(15); exit(0); }
+
+	if (pipe(pipe_fds) < 0)
+	{ print_failure(15); exit(0); }
+
+	if (ioctl(device0_fd, MSG_SLOT_CHANNEL, 4242) < 0)
+	{ print_failure(15); exit(0); }
+
+	// pipe -> channel
+	if (write(pipe_fds[1], "spliced", 7) != 7)
+	{ print_failure(15); exit(0); }
+
+	if (splice(pipe_fds[0], NULL, device0_fd, NULL, 7, 0) != 7)
+	{ print_failure(15); exit(0); }
+
+	// channel -> pipe, twice: the message stays in the channel
+	if (splice(device0_fd, &offset, pipe_fds[1], NULL, 128, 0) != 7)
+	{ print_failure(15); exit(0); }
+
+	offset = 0;
+	if (splice(device0_fd, &offset, pipe_fds[1], NULL, 128, 0) != 7)
+	{ print_failure(15); exit(0); }
+
+	if (read(pipe_fds[0], msg, 128) != 14)
+	{ print_failure(15); exit(0); }
+
+	msg[14] = '\0';
+	if (strcmp(msg, "splicedspliced"))
+	{ print_failure(15); exit(0); }
+
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	close(device0_fd);
+
+	print_success(15);
+}
+
+void test16()
+{
+	int device0_fd;
+	__u64 channel_ids[3] = {7001, 7002, 7003};
+	struct message_slot_broadcast request;
+	char msg[128];
+
+	device0_fd = open(DEV0, O_RDWR);
+	if (device0_fd < 0)
+	{ print_failure(16); exit(0); }
+
+	request.channel_ids = (__u64)(unsigned long)channel_ids;
+	request.message = (__u64)(unsigned long)"fanout";
+	request.num_channels = 3;
+	request.length = 6;
+	if (ioctl(device0_fd, MSG_SLOT_BROADCAST, &request) < 0)
+	{ print_failure(16); exit(0); }
+
+	// overwriting one channel must not change the others
+	if (ioctl(device0_fd, MSG_SLOT_CHANNEL, 7002) < 0)
+	{ print_failure(16); exit(0); }
+
+	if (write(device0_fd, "own", 3) != 3)
+	{ print_failure(16); exit(0); }
+
+	if (ioctl(device0_fd, MSG_SLOT_CHANNEL, 7003) < 0)
+	{ print_failure(16); exit(0); }
+
+	if (read(device0_fd, msg, 128) != 6 || strncmp(msg, "fanout", 6))
+	{ print_failure(16); exit(0); }
+
+	if (ioctl(device0_fd, MSG_SLOT_CHANNEL, 7002) < 0)
+	{ print_failure(16); exit(0); }
+
+	if (read(device0_fd, msg, 128) != 3 || strncmp(msg, "own", 3))
+	{ print_failure(16); exit(0); }
+
+	close(device0_fd);
+
+	print_success(16);
+}
+
+void test17()
+{
+	int device1_fd;
+	char msg[128];
+
+	device1_fd = open(DEV1, O_RDWR);
+	if (device1_fd < 0)
+	{ print_failure(17); exit(0); }
+
+	if (ioctl(device1_fd, MSG_SLOT_SET_TTL, 100) < 0)
+	{ print_failure(17); exit(0); }
+
+	if (ioctl(device1_fd, MSG_SLOT_CHANNEL, 31) < 0)
+	{ print_failure(17); exit(0); }
+
+	if (write(device1_fd, "short lived", 11) != 11)
+	{ print_failure(17); exit(0); }
+
+	if (read(device1_fd, msg, 128) != 11)
+	{ print_failure(17); exit(0); }
+
+	usleep(300 * 1000);
+
+	if (read(device1_fd, msg, 128) != -1 || errno != EWOULDBLOCK)
+	{ print_failure(17); exit(0); }
+
+	// don't leave the TTL behind for later runs
+	if (ioctl(device1_fd, MSG_SLOT_SET_TTL, 0) < 0)
+	{ print_failure(17); exit(0); }
+
+	close(device1_fd);
+
+	print_success(17);
+}
+
+void test18()
+{
+	int device1_fd;
+	struct message_slot_channel_info info[4];
+	struct message_slot_list_channels request;
+	__u64 last = 0;
+	unsigned int i;
+	int found = 0;
+
+	device1_fd = open(DEV1, O_RDWR);
+	if (device1_fd < 0)
+	{ print_failure(18); exit(0); }
+
+	if (ioctl(device1_fd, MSG_SLOT_CHANNEL, 12345) < 0)
+	{ print_failure(18); exit(0); }
+
+	if (write(device1_fd, "listed", 6) != 6)
+	{ print_failure(18); exit(0); }
+
+	request.cursor = 0;
+	request.channels = (__u64)(unsigned long)info;
+	request.max_channels = 4;
+	do {
+		if (ioctl(device1_fd, MSG_SLOT_LIST_CHANNELS, &request) < 0)
+		{ print_failure(18); exit(0); }
+
+		for (i = 0; i < request.num_channels; ++i) {
+			// channels come in increasing id order
+			if (info[i].channel_id <= last)
+			{ print_failure(18); exit(0); }
+			last = info[i].channel_id;
+			if (last == 12345 && info[i].length == 6)
+				found = 1;
+		}
+	} while (request.cursor != 0);
+
+	if (!found)
+	{ print_failure(18); exit(0); }
+
+	close(device1_fd);
+
+	print_success(18);
+}
+
+void test19()
+{
+	int control_fd, slot_fd, other_fd;
+	struct message_slot_create request;
+	char msg[128];
+
+	control_fd = open(CONTROL, O_RDWR);
+	if (control_fd < 0)
+	{ print_failure(19); exit(0); }
+
+	memset(&request, 0, sizeof(request));
+	request.flags = O_CLOEXEC;
+	slot_fd = ioctl(control_fd, MSG_SLOT_CREATE, &request);
+	if (slot_fd < 0)
+	{ print_failure(19); exit(0); }
+
+	if (ioctl(slot_fd, MSG_SLOT_CHANNEL, 3) < 0)
+	{ print_failure(19); exit(0); }
+
+	if (write(slot_fd, "anonymous", 9) != 9)
+	{ print_failure(19); exit(0); }
+
+	// a second fd on the same slot sees the message
+	other_fd = ioctl(control_fd, MSG_SLOT_OPEN, &request);
+	if (other_fd < 0)
+	{ print_failure(19); exit(0); }
+
+	if (ioctl(other_fd, MSG_SLOT_CHANNEL, 3) < 0)
+	{ print_failure(19); exit(0); }
+
+	if (read(other_fd, msg, 128) != 9 || strncmp(msg, "anonymous", 9))
+	{ print_failure(19); exit(0); }
+
+	if (ioctl(control_fd, MSG_SLOT_DESTROY, request.slot_id) < 0)
+	{ print_failure(19); exit(0); }
+
+	// gone for new opens, still there for open fds
+	if (ioctl(control_fd, MSG_SLOT_OPEN, &request) >= 0 || errno != ENOENT)
+	{ print_failure(19); exit(0); }
+
+	if (read(slot_fd, msg, 128) != 9)
+	{ print_failure(19); exit(0); }
+
+	close(other_fd);
+	close(slot_fd);
+	close(control_fd);
+
+	print_success(19);
+}
+
+void test20()
+{
+	int device0_fd;
+	struct message_slot_header header;
+	struct timespec now;
+	char msg[sizeof(header) + 128];
+
+	device0_fd = open(DEV0, O_RDWR);
+	if (device0_fd < 0)
+	{ print_failure(20); exit(0); }
+
+	if (ioctl(device0_fd, MSG_SLOT_CHANNEL, 20) < 0)
+	{ print_failure(20); exit(0); }
+
+	if (write(device0_fd, "stamped", 7) != 7)
+	{ print_failure(20); exit(0); }
+
+	if (ioctl(device0_fd, MSG_SLOT_READ_HEADER, 1) < 0)
+	{ print_failure(20); exit(0); }
+
+	if (read(device0_fd, msg, sizeof(msg)) != (ssize_t)(sizeof(header) + 7))
+	{ print_failure(20); exit(0); }
+
+	memcpy(&header, msg, sizeof(header));
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (header.length != 7 || header.writer_pid != (__u32)getpid() || header.sequence == 0 ||
+	    header.write_time_ns == 0 ||
+	    header.write_time_ns > (__u64)now.tv_sec * 1000000000ULL + now.tv_nsec ||
+	    strncmp(msg + sizeof(header), "stamped", 7))
+	{ print_failure(20); exit(0); }
+
+	// and back to plain messages
+	if (ioctl(device0_fd, MSG_SLOT_READ_HEADER, 0) < 0)
+	{ print_failure(20); exit(0); }
+
+	if (read(device0_fd, msg, sizeof(msg)) != 7)
+	{ print_failure(20); exit(0); }
+
+	close(device0_fd);
+
+	print_success(20);
+}
+
+void test21()
+{
+	int control_fd, slot_fd;
+	struct message_slot_create request;
+	char msg[128];
+	int i;
+
+	control_fd = open(CONTROL, O_RDWR);
+	if (control_fd < 0)
+	{ print_failure(21); exit(0); }
+
+	memset(&request, 0, sizeof(request));
+	request.slot_flags = MSG_SLOT_ARENA;
+	slot_fd = ioctl(control_fd, MSG_SLOT_CREATE, &request);
+	if (slot_fd < 0)
+	{ print_failure(21); exit(0); }
+
+	// enough channels and overwrites to need several chunks and reuse cells
+	for (i = 1; i <= 3000; ++i) {
+		if (ioctl(slot_fd, MSG_SLOT_CHANNEL, i) < 0)
+		{ print_failure(21); exit(0); }
+		if (write(slot_fd, "first", 5) != 5 || write(slot_fd, "second", 6) != 6)
+		{ print_failure(21); exit(0); }
+	}
+
+	if (ioctl(slot_fd, MSG_SLOT_CHANNEL, 1234) < 0)
+	{ print_failure(21); exit(0); }
+
+	if (read(slot_fd, msg, 128) != 6 || strncmp(msg, "second", 6))
+	{ print_failure(21); exit(0); }
+
+	if (ioctl(control_fd, MSG_SLOT_DESTROY, request.slot_id) < 0)
+	{ print_failure(21); exit(0); }
+
+	close(slot_fd);
+	close(control_fd);
+
+	print_success(21);
+}
+
+void test22()
+{
+	int device0_fd, control_fd, slot_fd;
+	int pipe_fds[2];
+	char *null_buffer = NULL;
+	__u64 channel_ids[2] = {4344, 4345};
+	struct message_slot_broadcast broadcast;
+	struct message_slot_create request;
+
+	// a NULL buffer is refused before anything is copied
+	device0_fd = open(DEV0, O_RDWR);
+	if (device0_fd < 0)
+	{ print_failure(22); exit(0); }
+
+	if (ioctl(device0_fd, MSG_SLOT_CHANNEL, 4343) < 0)
+	{ print_failure(22); exit(0); }
+
+	if (write(device0_fd, null_buffer, 5) >= 0 || errno != EINVAL)
+	{ print_failure(22); exit(0); }
+
+	// NULL offset splices on a device node fd and on an anonymous fd
+	splice_new_messages(device0_fd, 22);
+
+	// a broadcast puts one message in both channels, each is spliced once
+	broadcast.channel_ids = (__u64)(unsigned long)channel_ids;
+	broadcast.message = (__u64)(unsigned long)"both";
+	broadcast.num_channels = 2;
+	broadcast.length = 4;
+	if (ioctl(device0_fd, MSG_SLOT_BROADCAST, &broadcast) < 0)
+	{ print_failure(22); exit(0); }
+
+	if (pipe(pipe_fds) < 0)
+	{ print_failure(22); exit(0); }
+
+	if (ioctl(device0_fd, MSG_SLOT_CHANNEL, 4344) < 0 ||
+	    splice(device0_fd, NULL, pipe_fds[1], NULL, 128, 0) != 4)
+	{ print_failure(22); exit(0); }
+
+	if (ioctl(device0_fd, MSG_SLOT_CHANNEL, 4345) < 0 ||
+	    splice(device0_fd, NULL, pipe_fds[1], NULL, 128, 0) != 4 ||
+	    splice(device0_fd, NULL, pipe_fds[1], NULL, 128, 0) != 0)
+	{ print_failure(22); exit(0); }
+
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+
+	control_fd = open(CONTROL, O_RDWR);
+	if (control_fd < 0)
+	{ print_failure(22); exit(0); }
+
+	memset(&request, 0, sizeof(request));
+	slot_fd = ioctl(control_fd, MSG_SLOT_CREATE, &request);
+	if (slot_fd < 0)
+	{ print_failure(22); exit(0); }
+
+	if (ioctl(slot_fd, MSG_SLOT_CHANNEL, 4343) < 0)
+	{ print_failure(22); exit(0); }
+
+	splice_new_messages(slot_fd, 22);
+
+	if (ioctl(control_fd, MSG_SLOT_DESTROY, request.slot_id) < 0)
+	{ print_failure(22); exit(0); }
+
+	close(slot_fd);
+	close(control_fd);
+	close(device0_fd);
+
+	print_success(22);
+}
+
+// splicing with a NULL offset forwards each new message once
+void splice_new_messages(int fd, int test_num)
+{
+	int pipe_fds[2];
+	char msg[128];
+
+	if (pipe(pipe_fds) < 0)
+	{ print_failure(test_num); exit(0); }
+
+	if (write(fd, "first", 5) != 5)
+	{ print_failure(test_num); exit(0); }
+
+	if (splice(fd, NULL, pipe_fds[1], NULL, 128, 0) != 5)
+	{ print_failure(test_num); exit(0); }
+
+	// already handed over
+	if (splice(fd, NULL, pipe_fds[1], NULL, 128, 0) != 0)
+	{ print_failure(test_num); exit(0); }
+
+	if (write(fd, "second", 6) != 6)
+	{ print_failure(test_num); exit(0); }
+
+	if (splice(fd, NULL, pipe_fds[1], NULL, 128, 0) != 6)
+	{ print_failure(test_num); exit(0); }
+
+	if (read(pipe_fds[0], msg, 128) != 11 || strncmp(msg, "firstsecond", 11))
+	{ print_failure(test_num); exit(0); }
+
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+}
+
 void print_success(int test_num)
 {
 	printf("TEST %d: Success\n", test_num);
@@ -0,0 +1,379 @@
+#include "message_gateway.h"
+
+#include <fcntl.h>      /* open */
+#include <unistd.h>     /* exit */
+#include <sys/ioctl.h>  /* ioctl */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+static char* INVALID_INPUT_ERROR_MESSAGE = "usage: gateway_loadtest <socket_path> <file> [clients] [rounds]\n"
+                                           "<file> must be the first device message_gateway was started with";
+
+// Load test for message_gateway. Every client owns channel <client + 1>
+// and does <rounds> rounds of writing a message and reading it back.
+// The same workload is run three ways and each reports throughput and
+// latency percentiles per operation:
+//   direct, fd per request - open/ioctl/write or read/close, like a
+//                            short-lived client with device access
+//   direct, shared fd      - one fd kept open, ioctl + write or read
+//   gateway                - all clients connected at once, each with
+//                            one request in flight
+// Then a writer process and a busy-polling reader measure one-way
+// delivery latency through the device, from the write time the module
+// stamps on each message (MSG_SLOT_READ_HEADER) to when the reader
+// has it. Messages overwritten before the reader got to them are
+// reported as missed.
+
+#define ONE_WAY_MESSAGES_PER_ROUND 200
+#define ONE_WAY_GAP_US 100
+#define ONE_WAY_CHANNEL 1000000
+
+struct results {
+    unsigned long long *latencies; // ns
+    unsigned int count;
+    unsigned int errors;
+    unsigned long long elapsed;    // ns
+};
+
+struct load_client {
+    int fd;
+    unsigned int round;
+    int reading;                   // waiting for the read of this round
+    unsigned long long sent_at;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, struct results *r)
+{
+    unsigned long long p50 = 0, p99 = 0, p999 = 0, max = 0;
+
+    qsort(r->latencies, r->count, sizeof(r->latencies[0]), compare_latencies);
+    if (r->count > 0) {
+        p50 = r->latencies[r->count / 2];
+        p99 = r->latencies[(unsigned long long)r->count * 99 / 100];
+        p999 = r->latencies[(unsigned long long)r->count * 999 / 1000];
+        max = r->latencies[r->count - 1];
+    }
+    printf("%-24s %9u ops %10.0f ops/s  p50 %7llu ns  p99 %8llu ns  p99.9 %8llu ns  max %9llu ns  errors %u\n",
+           name, r->count, r->count / (r->elapsed / 1e9), p50, p99, p999, max, r->errors);
+}
+
+static void message_for(char *message, unsigned int client, unsigned int round, __u32 *length)
+{
+    *length = snprintf(message, MAX_MESSAGE_LENGTH, "client %u round %u", client, round);
+}
+
+//================== DIRECT =====================================
+
+static int direct_op(int file_desc, unsigned int client, unsigned int round, int reading)
+{
+    char message[MAX_MESSAGE_LENGTH], the_message[MAX_MESSAGE_LENGTH];
+    __u32 length;
+    ssize_t ret_val;
+
+    message_for(message, client, round, &length);
+    if (ioctl( file_desc, MSG_SLOT_CHANNEL, client + 1) < 0)
+        return -1;
+    if (!reading)
+        return write( file_desc, message, length) == (ssize_t)length ? 0 : -1;
+    ret_val = read( file_desc, the_message, MAX_MESSAGE_LENGTH );
+    return ret_val == (ssize_t)length && memcmp(message, the_message, length) == 0 ? 0 : -1;
+}
+
+static void run_direct(const char *path, unsigned int clients, unsigned int rounds, int fd_per_request,
+                       struct results *r)
+{
+    unsigned long long start, op_start;
+    unsigned int client, round;
+    int reading, file_desc = -1;
+
+    if (!fd_per_request) {
+        file_desc = open(path, O_RDWR );
+        if( file_desc < 0 ) {
+            perror("Error opening file: ");
+            exit(1);
+        }
+    }
+    start = now_ns();
+    for (round = 0; round < rounds; ++round) {
+        for (client = 0; client < clients; ++client) {
+            for (reading = 0; reading <= 1; ++reading) {
+                op_start = now_ns();
+                if (fd_per_request)
+                    file_desc = open(path, O_RDWR );
+                if (file_desc < 0 || direct_op(file_desc, client, round, reading) < 0)
+                    ++r->errors;
+                if (fd_per_request && file_desc >= 0)
+                    close(file_desc);
+                r->latencies[r->count++] = now_ns() - op_start;
+            }
+        }
+    }
+    r->elapsed = now_ns() - start;
+    if (!fd_per_request)
+        close(file_desc);
+}
+
+//================== ONE-WAY ====================================
+
+static void one_way_writer(const char *path, unsigned int messages)
+{
+    char message[MAX_MESSAGE_LENGTH];
+    unsigned int i;
+    int file_desc;
+
+    file_desc = open(path, O_RDWR );
+    if (file_desc < 0 || ioctl( file_desc, MSG_SLOT_CHANNEL, ONE_WAY_CHANNEL) < 0) {
+        perror("Error opening file: ");
+        exit(1);
+    }
+    for (i = 0; i < messages; ++i) {
+        if (write( file_desc, message, snprintf(message, sizeof(message), "%u", i)) < 0) {
+            perror("Error writing to channel: ");
+            exit(1);
+        }
+        usleep(ONE_WAY_GAP_US);
+    }
+    close(file_desc);
+    exit(0);
+}
+
+static void run_one_way(const char *path, unsigned int messages, struct results *r, unsigned int *missed)
+{
+    char buffer[sizeof(struct message_slot_header) + MAX_MESSAGE_LENGTH];
+    struct message_slot_header header;
+    unsigned long long start, last_seq = 0;
+    ssize_t ret_val;
+    int file_desc, status, writer_done = 0;
+    pid_t writer;
+
+    file_desc = open(path, O_RDWR );
+    if (file_desc < 0 || ioctl( file_desc, MSG_SLOT_CHANNEL, ONE_WAY_CHANNEL) < 0 ||
+        ioctl( file_desc, MSG_SLOT_READ_HEADER, 1) < 0) {
+        perror("Error opening file: ");
+        exit(1);
+    }
+    // whatever a previous run left in the channel doesn't count
+    if (read( file_desc, buffer, sizeof(buffer) ) >= (ssize_t)sizeof(header)) {
+        memcpy(&header, buffer, sizeof(header));
+        last_seq = header.sequence;
+    }
+
+    start = now_ns();
+    writer = fork();
+    if (writer < 0) {
+        perror("Error starting writer: ");
+        exit(1);
+    }
+    if (writer == 0)
+        one_way_writer(path, messages);
+
+    // one more pass after the writer is gone picks up its last message
+    while (!writer_done) {
+        writer_done = waitpid(writer, &status, WNOHANG) == writer;
+        ret_val = read( file_desc, buffer, sizeof(buffer) );
+        if (ret_val < (ssize_t)sizeof(header))
+            continue;
+        memcpy(&header, buffer, sizeof(header));
+        if (header.sequence == last_seq)
+            continue;
+        r->latencies[r->count++] = now_ns() - header.write_time_ns;
+        last_seq = header.sequence;
+    }
+    r->elapsed = now_ns() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        ++r->errors;
+    *missed = messages > r->count ? messages - r->count : 0;
+    close(file_desc);
+}
+
+//================== GATEWAY ====================================
+
+static void send_request(struct load_client *c, unsigned int client)
+{
+    struct gateway_request request;
+
+    memset(&request, 0, GATEWAY_REQUEST_HEADER_SIZE);
+    request.op = c->reading ? GATEWAY_OP_READ : GATEWAY_OP_WRITE;
+    request.slot = 0;
+    request.channel_id = client + 1;
+    if (!c->reading)
+        message_for(request.message, client, c->round, &request.length);
+    c->sent_at = now_ns();
+    if (send(c->fd, &request, GATEWAY_REQUEST_HEADER_SIZE + request.length, MSG_NOSIGNAL) < 0) {
+        perror("Error sending request: ");
+        exit(1);
+    }
+}
+
+static int connect_client(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating socket: ");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Error connecting to gateway: ");
+        exit(1);
+    }
+    return fd;
+}
+
+static void run_gateway(const char *socket_path, unsigned int clients, unsigned int rounds, struct results *r)
+{
+    struct load_client *load_clients;
+    struct epoll_event event, *events;
+    struct gateway_response response;
+    char message[MAX_MESSAGE_LENGTH];
+    unsigned long long start;
+    unsigned int i, client, done = 0;
+    __u32 length;
+    ssize_t ret_val;
+    int epoll_fd, n, j;
+
+    load_clients = calloc(clients, sizeof(*load_clients));
+    events = calloc(clients, sizeof(*events));
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (load_clients == NULL || events == NULL || epoll_fd < 0) {
+        perror("Error setting up clients: ");
+        exit(1);
+    }
+    for (i = 0; i < clients; ++i) {
+        load_clients[i].fd = connect_client(socket_path);
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, load_clients[i].fd, &event) < 0) {
+            perror("Error adding client to epoll: ");
+            exit(1);
+        }
+    }
+
+    start = now_ns();
+    for (i = 0; i < clients; ++i)
+        send_request(&load_clients[i], i);
+    while (done < clients) {
+        n = epoll_wait(epoll_fd, events, clients, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error waiting for responses: ");
+            exit(1);
+        }
+        for (j = 0; j < n; ++j) {
+            client = events[j].data.u32;
+            struct load_client *c = &load_clients[client];
+            ret_val = recv(c->fd, &response, sizeof(response), 0);
+            if (ret_val < (ssize_t)GATEWAY_RESPONSE_HEADER_SIZE) {
+                fprintf(stderr, "Gateway closed the connection\n");
+                exit(1);
+            }
+            r->latencies[r->count++] = now_ns() - c->sent_at;
+            if (response.status != 0) {
+                ++r->errors;
+            } else if (c->reading) {
+                message_for(message, client, c->round, &length);
+                if (response.length != length || memcmp(message, response.message, length) != 0)
+                    ++r->errors;
+            }
+            if (c->reading && ++c->round == rounds) {
+                ++done;
+                continue;
+            }
+            c->reading = !c->reading;
+            send_request(c, client);
+        }
+    }
+    r->elapsed = now_ns() - start;
+
+    for (i = 0; i < clients; ++i)
+        close(load_clients[i].fd);
+    close(epoll_fd);
+    free(events);
+    free(load_clients);
+}
+
+//================== MAIN =======================================
+
+int main(int argc, char *argv[])
+{
+    struct results results;
+    struct rlimit limit;
+    unsigned int clients = 2000, rounds = 50, missed;
+    size_t max_ops;
+
+    if (argc < 3 || argc > 5) {
+        write(STDERR_FILENO, INVALID_INPUT_ERROR_MESSAGE, strlen(INVALID_INPUT_ERROR_MESSAGE));
+        exit(1);
+    }
+    if (argc > 3)
+        clients = strtoul(argv[3], NULL, 10);
+    if (argc > 4)
+        rounds = strtoul(argv[4], NULL, 10);
+    if (clients == 0 || rounds == 0) {
+        write(STDERR_FILENO, INVALID_INPUT_ERROR_MESSAGE, strlen(INVALID_INPUT_ERROR_MESSAGE));
+        exit(1);
+    }
+
+    // one fd per client
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < clients + 64) {
+        limit.rlim_cur = limit.rlim_max < clients + 64 ? limit.rlim_max : clients + 64;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    max_ops = 2 * (size_t)clients * rounds;
+    if (max_ops < (size_t)ONE_WAY_MESSAGES_PER_ROUND * rounds)
+        max_ops = (size_t)ONE_WAY_MESSAGES_PER_ROUND * rounds;
+    results.latencies = malloc(sizeof(results.latencies[0]) * max_ops);
+    if (results.latencies == NULL) {
+        perror("Error allocating results: ");
+        exit(1);
+    }
+    printf("%u clients, %u rounds of write + read each\n", clients, rounds);
+
+    results.count = results.errors = 0;
+    run_direct(argv[2], clients, rounds, 1, &results);
+    report("direct, fd per request", &results);
+
+    results.count = results.errors = 0;
+    run_direct(argv[2], clients, rounds, 0, &results);
+    report("direct, shared fd", &results);
+
+    results.count = results.errors = 0;
+    run_gateway(argv[1], clients, rounds, &results);
+    report("gateway", &results);
+
+    results.count = results.errors = 0;
+    run_one_way(argv[2], ONE_WAY_MESSAGES_PER_ROUND * rounds, &results, &missed);
+    report("one-way, direct", &results);
+    printf("%-24s %9u messages overwritten before the reader saw them\n", "", missed);
+
+    free(results.latencies);
+    return 0;
+}
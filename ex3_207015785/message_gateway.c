@@ -0,0 +1,362 @@
+#define _GNU_SOURCE /* accept4 */
+#include "message_gateway.h"
+
+#include <fcntl.h>      /* open */
+#include <unistd.h>     /* exit */
+#include <sys/ioctl.h>  /* ioctl */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+static char* INVALID_INPUT_ERROR_MESSAGE = "usage: message_gateway <socket_path> <file>...";
+
+// message_gateway owns the message_slot device fds and serves clients
+// that can't open the devices themselves over a Unix socket.
+//
+// Every epoll wakeup collects the requests of all ready clients into
+// one batch, sorts it by (slot, channel) and runs it against the
+// devices. Within a channel the requests keep their arrival order, so
+// a client reading after its own write sees it. Sorting makes
+// consecutive requests share a channel, so MSG_SLOT_CHANNEL is only
+// issued when the channel actually changes, and of a run of writes to
+// the same channel only the last one is run: nobody could have read
+// the others before they were overwritten. The others are acked only
+// once that last write succeeded; if it fails they are run in order.
+
+#define MAX_EVENTS 256
+#define MAX_CLIENT_BATCH 16   // requests taken from one client per wakeup
+#define MAX_BATCH (MAX_EVENTS * MAX_CLIENT_BATCH)
+
+struct slot_fd {
+    int fd;
+    unsigned long int current_channel; // 0 until the first MSG_SLOT_CHANNEL
+};
+
+struct client {
+    int fd;
+    int closing;
+    int in_batch;
+    unsigned int events; // what epoll currently waits for on fd
+    int num_pending;   // responses of the current batch
+    int num_sent;      // of which already sent
+    struct gateway_response pending[MAX_CLIENT_BATCH];
+};
+
+struct batch_op {
+    struct gateway_request request;
+    struct gateway_response *response;
+    struct client *client;
+    unsigned int order;
+    int truncated; // a write packet holding fewer bytes than its length
+};
+
+static struct slot_fd *slots;
+static unsigned int num_slots;
+static struct batch_op batch[MAX_BATCH];
+static struct client *batch_clients[MAX_EVENTS];
+
+static int compare_ops(const void *a, const void *b)
+{
+    const struct batch_op *x = a, *y = b;
+    if (x->request.slot != y->request.slot)
+        return x->request.slot < y->request.slot ? -1 : 1;
+    if (x->request.channel_id != y->request.channel_id)
+        return x->request.channel_id < y->request.channel_id ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int select_channel(struct slot_fd *slot, unsigned long int channel_id)
+{
+    if (slot->current_channel == channel_id)
+        return 0;
+    if (ioctl( slot->fd, MSG_SLOT_CHANNEL, channel_id) < 0) {
+        slot->current_channel = 0;
+        return -errno;
+    }
+    slot->current_channel = channel_id;
+    return 0;
+}
+
+static int is_valid_write(const struct batch_op *op)
+{
+    const struct gateway_request *request = &op->request;
+    return request->op == GATEWAY_OP_WRITE && request->slot < num_slots && request->channel_id != 0 &&
+           request->length > 0 && request->length <= MAX_MESSAGE_LENGTH && !op->truncated;
+}
+
+static void run_op(struct batch_op *op)
+{
+    struct gateway_request *request = &op->request;
+    struct gateway_response *response = op->response;
+    struct slot_fd *slot;
+    ssize_t ret_val;
+
+    response->status = 0;
+    response->length = 0;
+    if (request->slot >= num_slots || request->channel_id == 0 ||
+        (request->op != GATEWAY_OP_WRITE && request->op != GATEWAY_OP_READ)) {
+        response->status = -EINVAL;
+        return;
+    }
+    if (request->op == GATEWAY_OP_WRITE && (request->length == 0 || request->length > MAX_MESSAGE_LENGTH)) {
+        response->status = -EMSGSIZE;
+        return;
+    }
+    if (op->truncated) {
+        response->status = -EINVAL;
+        return;
+    }
+
+    slot = &slots[request->slot];
+    response->status = select_channel(slot, request->channel_id);
+    if (response->status != 0)
+        return;
+
+    if (request->op == GATEWAY_OP_WRITE) {
+        ret_val = write( slot->fd, request->message, request->length);
+    } else {
+        ret_val = read( slot->fd, response->message, MAX_MESSAGE_LENGTH );
+        if (ret_val > 0)
+            response->length = ret_val;
+    }
+    if (ret_val < 0)
+        response->status = -errno;
+}
+
+// run ops[0], or the whole run of valid writes to its channel that it
+// starts; returns how many ops were run
+static unsigned int run_ops(struct batch_op *ops, unsigned int num_ops)
+{
+    unsigned int n = 1, i;
+
+    if (!is_valid_write(&ops[0])) {
+        run_op(&ops[0]);
+        return 1;
+    }
+    while (n < num_ops && is_valid_write(&ops[n]) &&
+           ops[n].request.slot == ops[0].request.slot && ops[n].request.channel_id == ops[0].request.channel_id)
+        ++n;
+
+    // the earlier writes are overwritten by the last one, if it lands
+    run_op(&ops[n - 1]);
+    for (i = 0; i + 1 < n; ++i) {
+        if (ops[n - 1].response->status == 0) {
+            ops[i].response->status = 0;
+            ops[i].response->length = 0;
+        } else {
+            run_op(&ops[i]);
+        }
+    }
+    return n;
+}
+
+// send what is pending; returns 0 once everything went out
+static int flush_client(struct client *c)
+{
+    struct gateway_response *response;
+    ssize_t ret_val;
+
+    while (c->num_sent < c->num_pending) {
+        response = &c->pending[c->num_sent];
+        ret_val = send(c->fd, response, GATEWAY_RESPONSE_HEADER_SIZE + response->length, MSG_NOSIGNAL);
+        if (ret_val < 0) {
+            if (errno == EAGAIN)
+                return -EAGAIN;
+            c->closing = 1;
+            return -errno;
+        }
+        ++c->num_sent;
+    }
+    c->num_pending = 0;
+    c->num_sent = 0;
+    return 0;
+}
+
+// take up to MAX_CLIENT_BATCH requests from a client into the batch
+static void collect_requests(struct client *c, unsigned int *num_ops)
+{
+    struct batch_op *op;
+    ssize_t ret_val;
+
+    while (c->num_pending < MAX_CLIENT_BATCH && *num_ops < MAX_BATCH) {
+        op = &batch[*num_ops];
+        ret_val = recv(c->fd, &op->request, sizeof(op->request), 0);
+        if (ret_val < 0) {
+            if (errno != EAGAIN)
+                c->closing = 1;
+            return;
+        }
+        if (ret_val == 0) {
+            c->closing = 1;
+            return;
+        }
+        if ((size_t)ret_val < GATEWAY_REQUEST_HEADER_SIZE) {
+            c->closing = 1;
+            return;
+        }
+        // answered with -EINVAL rather than storing a message the client didn't describe
+        op->truncated = op->request.op == GATEWAY_OP_WRITE && op->request.length <= MAX_MESSAGE_LENGTH &&
+                        GATEWAY_REQUEST_HEADER_SIZE + op->request.length > (size_t)ret_val;
+        op->client = c;
+        op->response = &c->pending[c->num_pending++];
+        op->order = (*num_ops)++;
+    }
+}
+
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int listen_fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        exit(1);
+    }
+    listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("Error creating socket: ");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Error binding socket: ");
+        exit(1);
+    }
+    // the whole point is serving clients without device permissions
+    chmod(path, 0666);
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        perror("Error listening on socket: ");
+        exit(1);
+    }
+    return listen_fd;
+}
+
+static void accept_clients(int epoll_fd, int listen_fd)
+{
+    struct epoll_event event;
+    struct client *c;
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        c = calloc(1, sizeof(*c));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        event.events = EPOLLIN;
+        event.data.ptr = c;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static struct epoll_event events[MAX_EVENTS];
+    struct epoll_event event;
+    struct client *c;
+    unsigned int i, num_ops, num_clients;
+    int listen_fd, epoll_fd, n, j;
+
+    if (argc < 3) {
+        write(STDERR_FILENO, INVALID_INPUT_ERROR_MESSAGE, strlen(INVALID_INPUT_ERROR_MESSAGE));
+        exit(1);
+    }
+
+    num_slots = argc - 2;
+    slots = calloc(num_slots, sizeof(*slots));
+    if (slots == NULL) {
+        perror("Error allocating slots: ");
+        exit(1);
+    }
+    for (i = 0; i < num_slots; ++i) {
+        slots[i].fd = open(argv[i + 2], O_RDWR | O_CLOEXEC);
+        if (slots[i].fd < 0) {
+            perror("Error opening file: ");
+            exit(1);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    listen_fd = open_socket(argv[1]);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("Error creating epoll: ");
+        exit(1);
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // the listening socket
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+        perror("Error adding socket to epoll: ");
+        exit(1);
+    }
+
+    for (;;) {
+        n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error waiting for clients: ");
+            exit(1);
+        }
+
+        // collect
+        num_ops = 0;
+        num_clients = 0;
+        for (j = 0; j < n; ++j) {
+            c = events[j].data.ptr;
+            if (c == NULL) {
+                accept_clients(epoll_fd, listen_fd);
+                continue;
+            }
+            if (events[j].events & EPOLLOUT)
+                flush_client(c);
+            // a client still waiting to get its responses out sends no more
+            if ((events[j].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && c->num_pending == 0)
+                collect_requests(c, &num_ops);
+            if (events[j].events & (EPOLLHUP | EPOLLERR))
+                c->closing = 1;
+            if (!c->in_batch) {
+                c->in_batch = 1;
+                batch_clients[num_clients++] = c;
+            }
+        }
+
+        // run
+        qsort(batch, num_ops, sizeof(batch[0]), compare_ops);
+        for (i = 0; i < num_ops; )
+            i += run_ops(&batch[i], num_ops - i);
+
+        // answer
+        for (i = 0; i < num_clients; ++i) {
+            c = batch_clients[i];
+            c->in_batch = 0;
+            if (!c->closing) {
+                // wait for room to send instead of for more requests
+                event.events = flush_client(c) == -EAGAIN ? EPOLLOUT : EPOLLIN;
+                event.data.ptr = c;
+                if (event.events != c->events && epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event) == 0)
+                    c->events = event.events;
+            }
+            if (c->closing) {
+                close(c->fd);
+                free(c);
+            }
+        }
+    }
+    return 0;
+}
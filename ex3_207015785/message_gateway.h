@@ -0,0 +1,35 @@
+#ifndef MESSAGE_GATEWAY_H
+#define MESSAGE_GATEWAY_H
+
+#include "message_slot.h"
+
+// Wire format between message_gateway and its clients.
+// The socket is a SOCK_SEQPACKET Unix socket, so every request and
+// every response is exactly one packet. A request carries length bytes
+// of message only for GATEWAY_OP_WRITE; a response carries length
+// bytes of message only for a successful GATEWAY_OP_READ. A write
+// packet shorter than its length is refused with -EINVAL. Responses
+// come back in the order the requests were sent.
+
+#define GATEWAY_OP_WRITE 1
+#define GATEWAY_OP_READ  2
+
+struct gateway_request {
+    __u32 op;
+    __u32 slot;           // index of the device in the gateway's command line
+    __u64 channel_id;
+    __u32 length;
+    __u32 reserved;
+    char message[MAX_MESSAGE_LENGTH];
+};
+
+struct gateway_response {
+    __s32 status;         // 0 or a negative errno from the device
+    __u32 length;
+    char message[MAX_MESSAGE_LENGTH];
+};
+
+#define GATEWAY_REQUEST_HEADER_SIZE  (sizeof(struct gateway_request) - MAX_MESSAGE_LENGTH)
+#define GATEWAY_RESPONSE_HEADER_SIZE (sizeof(struct gateway_response) - MAX_MESSAGE_LENGTH)
+
+#endif
@@ -8,16 +8,134 @@
 #include <linux/ioctl.h>
 #include <linux/types.h>
 #include <string.h>
+#include <errno.h>
 
-static char* INVALID_INPUT_ERROR_MESSAGE = "usage: message_reader <file> <channel_id>";
+static char* INVALID_INPUT_ERROR_MESSAGE = "usage: message_reader <file> <channel_id>\n"
+                                           "       message_reader <file> --stream [--binary] [--once] [--interval <ms>] <channel_id>...";
+
+// Streaming mode keeps polling the given channels over one open fd and
+// emits a record whenever a channel holds a message it hasn't emitted
+// yet. The fd reads with MSG_SLOT_READ_HEADER, so a new message is told
+// apart by its sequence number and a payload written twice in a row is
+// emitted twice. Records use the same formats message_sender --stream reads: text lines of
+// "<channel_id> <message>\n", or with --binary a __u32 channel id and a
+// __u32 length in host byte order followed by the message. Output is
+// buffered and flushed once per pass. --once stops after one pass.
+
+struct watched_channel {
+    unsigned long int channel_id;
+    __u64 sequence; // of the last message emitted, 0 if none yet
+};
+
+static void emit_record(struct watched_channel *c, const char *message, __u32 length, int binary)
+{
+    __u32 header[2];
+
+    if (binary) {
+        header[0] = c->channel_id;
+        header[1] = length;
+        fwrite(header, sizeof(header), 1, stdout);
+        fwrite(message, 1, length, stdout);
+    } else {
+        fprintf(stdout, "%lu %.*s\n", c->channel_id, (int)length, message);
+    }
+}
+
+static void stream_channels(int file_desc, struct watched_channel *channels, int num_channels,
+                            int binary, int once, useconds_t interval)
+{
+    static char the_message[sizeof(struct message_slot_header) + MAX_MESSAGE_LENGTH];
+    struct message_slot_header header;
+    unsigned long int current_channel = 0;
+    int i, emitted;
+    ssize_t ret_val;
+
+    if (ioctl( file_desc, MSG_SLOT_READ_HEADER, 1) < 0) {
+        perror("Error enabling message headers: ");
+        exit(1);
+    }
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    for (;;) {
+        emitted = 0;
+        for (i = 0; i < num_channels; ++i) {
+            struct watched_channel *c = &channels[i];
+            if (c->channel_id != current_channel) {
+                if (ioctl( file_desc, MSG_SLOT_CHANNEL, c->channel_id) < 0) {
+                    perror("Error changing channel: ");
+                    exit(1);
+                }
+                current_channel = c->channel_id;
+            }
+            ret_val = read( file_desc, the_message, sizeof(the_message) );
+            if (ret_val < 0) {
+                if (errno == EWOULDBLOCK)
+                    continue;
+                perror("Error reading from channel: ");
+                exit(1);
+            }
+            if (ret_val < (ssize_t)sizeof(header)) {
+                fprintf(stderr, "Error reading from channel: short message header\n");
+                exit(1);
+            }
+            memcpy(&header, the_message, sizeof(header));
+            if (header.sequence == c->sequence)
+                continue;
+            c->sequence = header.sequence;
+            emit_record(c, the_message + sizeof(header), header.length, binary);
+            emitted = 1;
+        }
+        if (emitted && fflush(stdout) != 0) {
+            perror("Error writing message to stdout: ");
+            exit(1);
+        }
+        if (once)
+            return;
+        usleep(interval);
+    }
+}
+
+static int stream_main(int argc, char *argv[], int file_desc)
+{
+    struct watched_channel *channels;
+    int num_channels = 0, binary = 0, once = 0, i;
+    useconds_t interval = 10 * 1000;
+
+    channels = calloc(argc, sizeof(*channels));
+    if (channels == NULL) {
+        perror("Error allocating channels: ");
+        exit(1);
+    }
+    for (i = 3; i < argc; ++i) {
+        if (strcmp(argv[i], "--binary") == 0) {
+            binary = 1;
+        } else if (strcmp(argv[i], "--once") == 0) {
+            once = 1;
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval = strtoul(argv[++i], NULL, 10) * 1000;
+        } else {
+            channels[num_channels].channel_id = strtoul(argv[i], NULL, 10);
+            channels[num_channels].sequence = 0;
+            ++num_channels;
+        }
+    }
+    if (num_channels == 0) {
+        write(STDERR_FILENO, INVALID_INPUT_ERROR_MESSAGE, strlen(INVALID_INPUT_ERROR_MESSAGE));
+        exit(1);
+    }
+
+    stream_channels(file_desc, channels, num_channels, binary, once, interval);
+    free(channels);
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
     static char the_message[MAX_MESSAGE_LENGTH];
     int ret_val, file_desc;
     unsigned long int channel_id;
+    int stream = argc >= 3 && strcmp(argv[2], "--stream") == 0;
 
-    if (argc != 3) {
+    if (argc != 3 && !stream) {
         write(STDERR_FILENO, INVALID_INPUT_ERROR_MESSAGE, strlen(INVALID_INPUT_ERROR_MESSAGE));
         exit(1);
     }
@@ -28,6 +146,12 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (stream) {
+        ret_val = stream_main(argc, argv, file_desc);
+        close(file_desc);
+        return ret_val;
+    }
+
     channel_id = atoi(argv[2]);
 
     ret_val = ioctl( file_desc, MSG_SLOT_CHANNEL, channel_id);
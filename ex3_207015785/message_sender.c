@@ -9,14 +9,81 @@
 #include <linux/types.h>
 #include <string.h>
 
-static char* INVALID_INPUT_ERROR_MESSAGE = "usage: message_sender <file> <channel_id> <message>";
+static char* INVALID_INPUT_ERROR_MESSAGE = "usage: message_sender <file> <channel_id> <message>\n"
+                                           "       message_sender <file> --stream [--binary]";
+
+// Streaming mode sends every record read from stdin over one open fd.
+// Text records are lines of "<channel_id> <message>\n". Binary records
+// (--binary) are a __u32 channel id and a __u32 length in host byte
+// order followed by length bytes of message, so messages may contain
+// newlines. The channel is only switched when the id changes.
+
+static void send_message(int file_desc, unsigned long int channel_id, unsigned long int *current_channel,
+                         const char *message, size_t length)
+{
+    if (channel_id != *current_channel) {
+        if (ioctl( file_desc, MSG_SLOT_CHANNEL, channel_id) < 0) {
+            perror("Error changing channel: ");
+            exit(1);
+        }
+        *current_channel = channel_id;
+    }
+    if (write( file_desc, message, length) < 0) {
+        perror("Error writing to channel: ");
+        exit(1);
+    }
+}
+
+static void stream_text(int file_desc)
+{
+    unsigned long int current_channel = 0;
+    unsigned long int channel_id;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    char *message;
+
+    while ((length = getline(&line, &capacity, stdin)) > 0) {
+        if (line[length - 1] == '\n')
+            line[--length] = '\0';
+        channel_id = strtoul(line, &message, 10);
+        if (message == line || *message != ' ') {
+            fprintf(stderr, "Invalid record: %s\n", line);
+            exit(1);
+        }
+        ++message;
+        send_message(file_desc, channel_id, &current_channel, message, length - (message - line));
+    }
+    free(line);
+}
+
+static void stream_binary(int file_desc)
+{
+    unsigned long int current_channel = 0;
+    static char message[MAX_MESSAGE_LENGTH];
+    __u32 header[2];
+
+    while (fread(header, sizeof(header), 1, stdin) == 1) {
+        if (header[1] > MAX_MESSAGE_LENGTH) {
+            fprintf(stderr, "Invalid record length %u\n", header[1]);
+            exit(1);
+        }
+        if (fread(message, 1, header[1], stdin) != header[1]) {
+            fprintf(stderr, "Truncated record\n");
+            exit(1);
+        }
+        send_message(file_desc, header[0], &current_channel, message, header[1]);
+    }
+}
 
 int main(int argc, char *argv[])
 {
     int ret_val, file_desc;
     unsigned long int channel_id;
+    int stream = argc >= 3 && strcmp(argv[2], "--stream") == 0;
+    int binary = stream && argc == 4 && strcmp(argv[3], "--binary") == 0;
 
-    if (argc != 4) {
+    if ((!stream && argc != 4) || (stream && argc != 3 && !binary)) {
         write(STDERR_FILENO, INVALID_INPUT_ERROR_MESSAGE, strlen(INVALID_INPUT_ERROR_MESSAGE));
         exit(1);
     }
@@ -27,6 +94,19 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (stream) {
+        if (binary)
+            stream_binary(file_desc);
+        else
+            stream_text(file_desc);
+        if (ferror(stdin)) {
+            perror("Error reading records: ");
+            exit(1);
+        }
+        close(file_desc);
+        return 0;
+    }
+
     channel_id = atoi(argv[2]);
 
     ret_val = ioctl( file_desc, MSG_SLOT_CHANNEL, channel_id);
@@ -44,4 +124,3 @@ int main(int argc, char *argv[])
     close(file_desc);
     return 0;
 }
-
@@ -1,12 +1,6 @@
-// Declare what kind of code we want
-// from the header files. Defining __KERNEL__
-// and MODULE allows us to access kernel-level
-// code not usually available to userspace programs.
-#undef __KERNEL__
-#define __KERNEL__
-#undef MODULE
-#define MODULE
-
+// kbuild defines __KERNEL__, and MODULE only when this is built as a
+// module (obj-m); built in, as for the KUnit run under UML, it must
+// stay undefined so THIS_MODULE and module_init resolve for vmlinux.
 
 #include <linux/kernel.h>   /* We're doing kernel work */
 #include <linux/module.h>   /* Specifically, a module */
@@ -15,6 +9,28 @@
 #include <linux/string.h>   /* for memset. NOTE - not string.h!*/
 #include <linux/errno.h>
 #include <linux/slab.h>
+#include <linux/kref.h>     /* for shared message buffers */
+#include <linux/mutex.h>
+#include <linux/xarray.h>   /* channel index */
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h> /* for expiring messages */
+#include <linux/jiffies.h>
+#include <linux/uio.h>      /* for iov_iter */
+#include <linux/debugfs.h>  /* for latency histograms */
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/version.h>
+#include <linux/spinlock.h> /* for the journal */
+#include <linux/wait.h>
+#include <linux/crc32.h>
+#include <linux/sizes.h>
+#include <linux/miscdevice.h> /* for the control device */
+#include <linux/anon_inodes.h>
+#include <linux/sched.h>    /* for the writer pid */
+#include <linux/pid.h>
 
 MODULE_LICENSE("GPL");
 
@@ -22,142 +38,1336 @@ MODULE_LICENSE("GPL");
 //Our custom definitions of IOCTL operations
 #include "message_slot.h"
 
+// A message payload. Payloads are immutable once written and are
+// shared by reference: a broadcast stores one message_buffer in every
+// target channel, and overwriting a channel just drops that channel's
+// reference (copy-on-overwrite), leaving the other channels untouched.
+struct message_buffer {
+    struct kref refcount;
+    unsigned long written; // jiffies when the message was stored
+    u64 timestamp;         // CLOCK_REALTIME ns when the message was stored
+    u64 write_time;        // CLOCK_MONOTONIC ns when the message was stored, 0 if replayed
+    u64 seq;               // message_slot write_seq of the write that stored it
+    struct pid *writer_pid; // tgid of the writer, NULL if replayed
+    struct slot_arena *arena; // where to free it, NULL for message_pool
+    ssize_t length;
+    char data[];
+};
+
 struct channel {
     unsigned long int channel_id;
-    char* message;
-    ssize_t length;
-    struct list_head channel_list ;
+    struct message_buffer *message; // NULL while the channel is empty
+    struct list_head expiry_list; // position in message_slot expiry_list_head while holding a message
+};
+
+// operations with a latency histogram
+enum slot_op {
+    SLOT_OP_OPEN,
+    SLOT_OP_IOCTL,
+    SLOT_OP_READ,
+    SLOT_OP_WRITE,
+    NR_SLOT_OPS,
+};
+
+// bucket i counts operations that took [2^i, 2^(i+1)) ns,
+// the last bucket also takes everything slower than that
+#define LATENCY_BUCKETS 32
+
+struct latency_hist {
+    u64 buckets[NR_SLOT_OPS][LATENCY_BUCKETS];
+};
+
+// fixed-size objects of one message_slot packed into chunks, see ARENAS
+struct slot_arena {
+    spinlock_t lock; // protects everything below
+    size_t object_size;
+    struct list_head chunks; // newest first, new objects are carved off the newest
+    void *free_list; // freed objects, linked through their first word
+    unsigned int num_chunks;
+    unsigned int in_use;
 };
 
 struct message_slot {
+    // the minor, or for a slot made through the control device an id
+    // from FIRST_ANONYMOUS_SLOT up
     unsigned long int device_minor;
-    struct list_head channel_list_head;
-    struct list_head message_slot_list ;
+    struct kref refcount; // one held by message_slots while indexed, one by every open file
+    bool destroyed; // by MSG_SLOT_DESTROY, protected by the journal lock
+    struct latency_hist __percpu *latency; // merged over all cpus when read
+    struct dentry *debugfs_dir;
+    struct mutex lock; // protects channels, expiry_list_head, ttl, write_seq and every channel's message
+    struct xarray channels; // channel_id -> channel, ordered so it can be enumerated with a cursor
+    u64 write_seq; // counts the writes to this slot
+    // Message expiry. All messages of a slot share one TTL, so a message
+    // expires at written + ttl and writing order is also expiry order.
+    // Channels holding a message are kept on expiry_list_head oldest
+    // first, and a single delayed work per slot frees expired messages
+    // from the head in batches - no timer per message.
+    unsigned long ttl; // in jiffies, 0 means messages never expire
+    struct list_head expiry_list_head;
+    struct delayed_work reclaim_work;
+    // fixed when the slot is created: channels and messages come
+    // from these arenas rather than channel_pool and message_pool
+    bool use_arena;
+    struct slot_arena channel_arena;
+    struct slot_arena message_arena;
 };
 
 struct file_data {
     struct channel *current_channel;
     struct message_slot *message_slot;
+    bool read_header; // MSG_SLOT_READ_HEADER: reads start with a message_slot_header
 };
 
 struct channel *get_channel_from_message_slot_ptr(unsigned long int channel_id, struct message_slot *message_slot);
+struct channel* create_channel(unsigned long int channel_id, struct message_slot *m);
 void delete_message_slot_from_ptr(struct message_slot *message_slot);
-void delete_all_channels(struct list_head channel_list_head);
+void put_message_slot(struct message_slot *message_slot);
+void delete_all_channels(struct xarray *channels);
 void delete_all_message_slots(void);
 int create_message_slot(unsigned long int device_minor, struct file *file);
 struct message_slot *get_message_slot(unsigned long int device_minor);
 
-static struct list_head message_slot_list_head;
+// slot id -> message_slot. minors index their slot directly; slots
+// made through the control device get ids above every possible minor
+#define FIRST_ANONYMOUS_SLOT (1UL << MINORBITS)
+static DEFINE_XARRAY_ALLOC(message_slots);
+static u32 next_anonymous_slot = FIRST_ANONYMOUS_SLOT; // where the search for a free id starts
+static DEFINE_MUTEX(message_slot_list_lock); // protects message_slots
+
+//================== LATENCY STATS ==============================
+// Histograms are off by default. While off, every record point is a
+// patched out static branch, so the hot paths don't even read the clock.
+// debugfs layout:
+//   message_slot/latency_enabled   - write 1/0 to switch recording on/off
+//   message_slot/<minor>/latency   - merged histograms of that slot
+//   message_slot/<minor>/latency_reset - write anything to clear them
+
+static DEFINE_STATIC_KEY_FALSE(latency_stats_enabled);
+static struct dentry *debugfs_root;
+
+static const char *slot_op_names[NR_SLOT_OPS] = {
+    [SLOT_OP_OPEN]  = "open",
+    [SLOT_OP_IOCTL] = "ioctl",
+    [SLOT_OP_READ]  = "read",
+    [SLOT_OP_WRITE] = "write",
+};
+
+static inline u64 latency_start(void) {
+    if (static_branch_unlikely(&latency_stats_enabled))
+        return ktime_get_ns();
+    return 0;
+}
+
+static inline void latency_record(struct message_slot *m, enum slot_op op, u64 start) {
+    u64 delta;
+    unsigned int bucket = 0;
+
+    // start is 0 when recording was off as the operation began
+    if (!static_branch_unlikely(&latency_stats_enabled) || start == 0 || m == NULL)
+        return;
+    delta = ktime_get_ns() - start;
+    if (delta > 0)
+        bucket = min_t(unsigned int, ilog2(delta), LATENCY_BUCKETS - 1);
+    this_cpu_inc(m->latency->buckets[op][bucket]);
+}
+
+static int latency_show(struct seq_file *s, void *unused) {
+    struct message_slot *m = s->private;
+    u64 merged[LATENCY_BUCKETS];
+    int cpu, op, bucket;
+
+    seq_puts(s, "op\tfrom_ns\tcount\n");
+    for (op = 0; op < NR_SLOT_OPS; ++op) {
+        memset(merged, 0, sizeof(merged));
+        for_each_possible_cpu(cpu) {
+            struct latency_hist *h = per_cpu_ptr(m->latency, cpu);
+            for (bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+                merged[bucket] += READ_ONCE(h->buckets[op][bucket]);
+        }
+        for (bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+            if (merged[bucket] != 0)
+                seq_printf(s, "%s\t%llu\t%llu\n", slot_op_names[op], 1ULL << bucket, merged[bucket]);
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static int latency_reset_set(void *data, u64 val) {
+    struct message_slot *m = data;
+    int cpu;
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(m->latency, cpu), 0, sizeof(struct latency_hist));
+    return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(latency_reset_fops, NULL, latency_reset_set, "%llu\n");
+
+static int latency_enabled_get(void *data, u64 *val) {
+    *val = static_key_enabled(&latency_stats_enabled);
+    return 0;
+}
+
+static int latency_enabled_set(void *data, u64 val) {
+    if (val)
+        static_branch_enable(&latency_stats_enabled);
+    else
+        static_branch_disable(&latency_stats_enabled);
+    return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(latency_enabled_fops, latency_enabled_get, latency_enabled_set, "%llu\n");
+
+// debugfs failures are not fatal: the slot just has no stats files
+static void create_slot_debugfs(struct message_slot *m) {
+    char name[24];
+    snprintf(name, sizeof(name), "%lu", m->device_minor);
+    m->debugfs_dir = debugfs_create_dir(name, debugfs_root);
+    debugfs_create_file("latency", 0444, m->debugfs_dir, m, &latency_fops);
+    debugfs_create_file_unsafe("latency_reset", 0200, m->debugfs_dir, m, &latency_reset_fops);
+}
+
+//================== OBJECT POOLS ===============================
+// Channels, messages and file_data are allocated on the hot path
+// (open, ioctl, write). These parameters reserve objects for them at
+// load time so the first burst of traffic doesn't pay for slab growth
+// and reclaim. A pool with no reserve just allocates from its cache.
+
+static unsigned int prealloc_slots;
+module_param(prealloc_slots, uint, 0444);
+MODULE_PARM_DESC(prealloc_slots, "create the message_slots for minors 0..prealloc_slots-1 at load time");
+
+static unsigned int prealloc_channels;
+module_param(prealloc_channels, uint, 0444);
+MODULE_PARM_DESC(prealloc_channels, "number of channels kept in reserve");
+
+static unsigned int prealloc_messages;
+module_param(prealloc_messages, uint, 0444);
+MODULE_PARM_DESC(prealloc_messages, "number of message buffers kept in reserve");
+
+static unsigned int prealloc_file_data;
+module_param(prealloc_file_data, uint, 0444);
+MODULE_PARM_DESC(prealloc_file_data, "number of open file states kept in reserve");
+
+struct object_pool {
+    struct kmem_cache *cache;
+    spinlock_t lock;   // protects free_list and free
+    void *free_list;   // preallocated objects, linked through their first word
+    unsigned int free; // number of objects on free_list
+    unsigned int reserve; // free_list is refilled up to this many objects
+};
+
+static struct object_pool channel_pool;
+static struct object_pool message_pool; // every buffer can hold MAX_MESSAGE_LENGTH bytes
+static struct object_pool file_data_pool;
+
+static void destroy_object_pool(struct object_pool *p) {
+    while (p->free_list != NULL) {
+        void **obj = p->free_list;
+        p->free_list = *obj;
+        kmem_cache_free(p->cache, obj);
+    }
+    kmem_cache_destroy(p->cache);
+    p->free = 0;
+    p->cache = NULL;
+}
+
+static int init_object_pool(struct object_pool *p, const char *name, size_t size, unsigned int reserve) {
+    p->cache = kmem_cache_create(name, size, 0, SLAB_HWCACHE_ALIGN, NULL);
+    if (p->cache == NULL) {
+        printk("failed creating cache %s\n", name);
+        return -ENOMEM;
+    }
+    spin_lock_init(&p->lock);
+    p->free_list = NULL;
+    p->free = 0;
+    p->reserve = reserve;
+    while (p->free < reserve) {
+        void **obj = kmem_cache_alloc(p->cache, GFP_KERNEL);
+        if (obj == NULL) {
+            printk("failed preallocating %u objects for %s\n", reserve, name);
+            destroy_object_pool(p);
+            return -ENOMEM;
+        }
+        *obj = p->free_list;
+        p->free_list = obj;
+        p->free++;
+    }
+    return SUCCESS;
+}
+
+// the preallocated objects are handed out first, so while the free
+// list has objects an allocation never touches the slab allocator.
+// only once it runs dry do we fall back to a regular (possibly
+// sleeping) allocation from the cache. the unlocked peek at free keeps
+// pools without a reserve, or with an empty one, off the lock; a stale
+// read only sends one allocation to the cache
+static void *object_pool_alloc(struct object_pool *p) {
+    void **obj = NULL;
+    if (READ_ONCE(p->free) != 0) {
+        spin_lock(&p->lock);
+        obj = p->free_list;
+        if (obj != NULL) {
+            p->free_list = *obj;
+            WRITE_ONCE(p->free, p->free - 1);
+        }
+        spin_unlock(&p->lock);
+    }
+    if (obj == NULL)
+        obj = kmem_cache_alloc(p->cache, GFP_KERNEL);
+    return obj;
+}
+
+// objects return to the free list until it holds the reserve again.
+// like object_pool_alloc, a full reserve is noticed without the lock
+static void object_pool_free(struct object_pool *p, void *obj) {
+    if (obj == NULL)
+        return;
+    if (READ_ONCE(p->free) < p->reserve) {
+        spin_lock(&p->lock);
+        if (p->free < p->reserve) {
+            *(void **)obj = p->free_list;
+            p->free_list = obj;
+            WRITE_ONCE(p->free, p->free + 1);
+            obj = NULL;
+        }
+        spin_unlock(&p->lock);
+    }
+    if (obj != NULL)
+        kmem_cache_free(p->cache, obj);
+}
+
+static void destroy_object_pools(void) {
+    destroy_object_pool(&file_data_pool);
+    destroy_object_pool(&message_pool);
+    destroy_object_pool(&channel_pool);
+}
+
+static int init_object_pools(void) {
+    int rc;
+    rc = init_object_pool(&channel_pool, "message_slot_channel", sizeof(struct channel), prealloc_channels);
+    if (rc == SUCCESS)
+        rc = init_object_pool(&message_pool, "message_slot_message",
+                              sizeof(struct message_buffer) + MAX_MESSAGE_LENGTH, prealloc_messages);
+    if (rc == SUCCESS)
+        rc = init_object_pool(&file_data_pool, "message_slot_file_data", sizeof(struct file_data), prealloc_file_data);
+    if (rc != SUCCESS)
+        destroy_object_pools();
+    return rc;
+}
+
+//================== ARENAS =====================================
+// In arena mode a message_slot packs its channels and message cells
+// into chunks of its own instead of taking them one by one from the
+// shared caches. New objects are carved off the newest chunk, freed
+// ones go on a free list and are reused first. Chunks start at a page
+// and double up to ARENA_MAX_CHUNK. They are only given back when the
+// slot is released, all at once, so no channel or message is freed on
+// its own. Teardown is still O(channels): every stored message holds a
+// reference to its writer's struct pid, which the release walk drops,
+// but that walk is a kref_put per channel instead of a cache free per
+// channel and message.
+//
+// arena_slots turns arena mode on for every slot created from then on
+// by opening a minor; MSG_SLOT_CREATE can ask for it per slot.
+
+static bool arena_slots;
+module_param(arena_slots, bool, 0644);
+MODULE_PARM_DESC(arena_slots, "allocate channels and messages of new message_slots from per-slot arenas");
+
+#define ARENA_MAX_CHUNK SZ_256K
+
+struct arena_chunk {
+    struct list_head list;
+    size_t size; // bytes available for objects
+    size_t used; // bytes carved off so far
+    unsigned long objects[];
+};
+
+static void init_arena(struct slot_arena *a, size_t object_size) {
+    spin_lock_init(&a->lock);
+    a->object_size = ALIGN(object_size, sizeof(unsigned long));
+    INIT_LIST_HEAD(&a->chunks);
+    a->free_list = NULL;
+    a->num_chunks = 0;
+    a->in_use = 0;
+}
+
+// must be called with the arena lock held
+static void *__arena_alloc(struct slot_arena *a) {
+    struct arena_chunk *chunk;
+    void *obj = a->free_list;
+
+    if (obj != NULL) {
+        a->free_list = *(void **)obj;
+    } else if (!list_empty(&a->chunks)) {
+        chunk = list_first_entry(&a->chunks, struct arena_chunk, list);
+        if (chunk->used + a->object_size <= chunk->size) {
+            obj = (char *)chunk->objects + chunk->used;
+            chunk->used += a->object_size;
+        }
+    }
+    if (obj != NULL)
+        ++a->in_use;
+    return obj;
+}
+
+static void *arena_alloc(struct slot_arena *a) {
+    struct arena_chunk *chunk;
+    size_t size;
+    void *obj;
+
+    spin_lock(&a->lock);
+    obj = __arena_alloc(a);
+    size = PAGE_SIZE << min_t(unsigned int, a->num_chunks, ilog2(ARENA_MAX_CHUNK / PAGE_SIZE));
+    spin_unlock(&a->lock);
+    if (obj != NULL)
+        return obj;
+
+    // out of room. the new chunk is allocated unlocked since that may
+    // sleep; if another one was added meanwhile, both get used
+    chunk = kvmalloc(size, GFP_KERNEL);
+    if (chunk == NULL) {
+        printk("failed allocating arena chunk of %zu bytes\n", size);
+        return NULL;
+    }
+    chunk->size = size - sizeof(*chunk);
+    chunk->used = 0;
+    spin_lock(&a->lock);
+    list_add(&chunk->list, &a->chunks);
+    ++a->num_chunks;
+    obj = __arena_alloc(a);
+    spin_unlock(&a->lock);
+    return obj;
+}
+
+static void arena_free(struct slot_arena *a, void *obj) {
+    spin_lock(&a->lock);
+    *(void **)obj = a->free_list;
+    a->free_list = obj;
+    --a->in_use;
+    spin_unlock(&a->lock);
+}
+
+// give back every chunk, along with whatever is still allocated in them
+static void destroy_arena(struct slot_arena *a) {
+    struct arena_chunk *chunk, *temp;
+    list_for_each_entry_safe(chunk, temp, &a->chunks, list)
+        kvfree(chunk);
+    init_arena(a, a->object_size);
+}
 
 //================== HELPER FUNCTIONS ===========================
 
-struct channel *get_channel_from_message_slot_ptr(unsigned long int channel_id, struct message_slot *message_slot) {
-    struct channel  *entry = NULL;
-    list_for_each_entry ( entry , & message_slot->channel_list_head, channel_list )
-    {
-        if (entry->channel_id == channel_id)
-            return entry;
+// write(2) with a NULL buffer is refused with -EINVAL, as before the
+// move to write_iter, instead of surfacing as a failed copy (-EIO)
+static bool iter_has_null_buffer(const struct iov_iter *from) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    return user_backed_iter(from) && iter_iov_addr(from) == NULL;
+#else
+    return iter_is_iovec(from) && from->iov->iov_base == NULL;
+#endif
+}
+
+static struct message_buffer *alloc_message_buffer(struct message_slot *m, ssize_t length) {
+    struct message_buffer *b;
+    if (length > MAX_MESSAGE_LENGTH)
+        return NULL;
+    if (m->use_arena)
+        b = arena_alloc(&m->message_arena);
+    else
+        b = object_pool_alloc(&message_pool);
+    if (b == NULL) {
+        printk("failed allocating memory for message\n");
+        return NULL;
+    }
+    kref_init(&b->refcount);
+    b->writer_pid = NULL;
+    b->arena = m->use_arena ? &m->message_arena : NULL;
+    b->length = length;
+    return b;
+}
+
+static void release_message_buffer(struct kref *kref) {
+    struct message_buffer *b = container_of(kref, struct message_buffer, refcount);
+    put_pid(b->writer_pid);
+    if (b->arena != NULL)
+        arena_free(b->arena, b);
+    else
+        object_pool_free(&message_pool, b);
+}
+
+static void put_message_buffer(struct message_buffer *b) {
+    if (b != NULL)
+        kref_put(&b->refcount, release_message_buffer);
+}
+
+// fill in when, by whom and in which order a message was stored,
+// right before it is published, so write_time is as close as it gets
+// to the moment a reader can see the message.
+// must be called with the message_slot lock held
+static void stamp_message(struct message_slot *m, struct message_buffer *b) {
+    b->written = jiffies;
+    b->write_time = ktime_get_ns();
+    b->timestamp = ktime_get_real_ns();
+    b->seq = ++m->write_seq;
+    // kept as a struct pid, readers see it in their own pid namespace
+    b->writer_pid = get_pid(task_tgid(current));
+}
+
+// must be called with the message_slot lock held
+static bool message_expired(struct message_slot *m, struct message_buffer *b) {
+    return m->ttl != 0 && time_after_eq(jiffies, b->written + m->ttl);
+}
+
+// the message of a channel, or NULL if it is empty or expired.
+// must be called with the message_slot lock held
+static struct message_buffer *channel_message(struct message_slot *m, struct channel *c) {
+    if (c->message == NULL || message_expired(m, c->message))
+        return NULL;
+    return c->message;
+}
+
+// replace the message of a channel with b (which may be NULL).
+// the channel takes its own reference, the caller keeps theirs.
+// b must have been stamped under this same hold of the lock, since
+// the expiry list is kept in writing order.
+// must be called with the message_slot lock held
+static void set_channel_message(struct message_slot *m, struct channel *c, struct message_buffer *b) {
+    struct message_buffer *old = c->message;
+    if (b != NULL) {
+        kref_get(&b->refcount);
+        list_move_tail(&c->expiry_list, &m->expiry_list_head);
+        if (m->ttl != 0)
+            schedule_delayed_work(&m->reclaim_work, m->ttl);
+    } else {
+        list_del_init(&c->expiry_list);
     }
+    c->message = b;
+    put_message_buffer(old);
+}
+
+// frees expired messages of a slot, at most RECLAIM_BATCH per round so
+// the slot lock is never held for long, then rearms itself for the
+// next message due to expire
+#define RECLAIM_BATCH 64
+static void reclaim_expired_messages(struct work_struct *work) {
+    struct message_slot *m = container_of(to_delayed_work(work), struct message_slot, reclaim_work);
+    struct message_buffer *expired[RECLAIM_BATCH];
+    struct channel *c;
+    unsigned long expires;
+    unsigned int n = 0, i;
+
+    mutex_lock(&m->lock);
+    while (n < RECLAIM_BATCH && !list_empty(&m->expiry_list_head)) {
+        c = list_first_entry(&m->expiry_list_head, struct channel, expiry_list);
+        if (!message_expired(m, c->message))
+            break;
+        expired[n++] = c->message;
+        c->message = NULL;
+        list_del_init(&c->expiry_list);
+    }
+    if (m->ttl != 0 && !list_empty(&m->expiry_list_head)) {
+        if (n == RECLAIM_BATCH) {
+            // there may be more, come back right away
+            schedule_delayed_work(&m->reclaim_work, 0);
+        } else {
+            c = list_first_entry(&m->expiry_list_head, struct channel, expiry_list);
+            expires = c->message->written + m->ttl;
+            schedule_delayed_work(&m->reclaim_work, time_after(expires, jiffies) ? expires - jiffies : 0);
+        }
+    }
+    mutex_unlock(&m->lock);
+
+    for (i = 0; i < n; ++i)
+        put_message_buffer(expired[i]);
+    if (n > 0)
+        printk("reclaimed %u expired messages from message_slot with minor %lu\n", n, m->device_minor);
+}
+
+// must be called with the message_slot lock held
+struct channel *get_channel_from_message_slot_ptr(unsigned long int channel_id, struct message_slot *message_slot) {
+    struct channel  *entry = xa_load(&message_slot->channels, channel_id);
+    if (entry != NULL)
+        return entry;
     printk("could not find channel %lu from message_slot ptr %p\n", channel_id, message_slot);
     return NULL;
 }
 
-void delete_message_slot_from_ptr(struct message_slot *m) {
+// arena teardown frees the cells wholesale, a message only drops its pid
+static void release_arena_message(struct kref *kref) {
+    struct message_buffer *b = container_of(kref, struct message_buffer, refcount);
+    put_pid(b->writer_pid);
+}
+
+static void release_message_slot(struct kref *kref) {
+    struct message_slot *m = container_of(kref, struct message_slot, refcount);
+    struct channel *c;
+    unsigned long int channel_id;
+    cancel_delayed_work_sync(&m->reclaim_work);
     printk("delete all message_slot's channels\n");
-    delete_all_channels(m->channel_list_head);
-    printk("delete message_slot from message_slot list\n");
-    list_del(&m->message_slot_list);
+    if (m->use_arena) {
+        // every channel and message is in the arenas, the channels are
+        // only walked for the writer pids; no cell is freed one by one.
+        // no message outlives its slot: whoever holds a reference to
+        // one also holds the slot, through an open file
+        xa_for_each(&m->channels, channel_id, c) {
+            if (c->message != NULL)
+                kref_put(&c->message->refcount, release_arena_message);
+        }
+        xa_destroy(&m->channels);
+        destroy_arena(&m->channel_arena);
+        destroy_arena(&m->message_arena);
+    } else {
+        delete_all_channels(&m->channels);
+    }
+    debugfs_remove_recursive(m->debugfs_dir);
+    free_percpu(m->latency);
     printk("delete message_slot struct from memory\n");
     kfree(m);
 }
 
-void delete_all_channels(struct list_head channel_list_head) {
-    struct channel  *entry, *temp = NULL ;
-    list_for_each_entry_safe ( entry , temp, &channel_list_head, channel_list )
+void put_message_slot(struct message_slot *m) {
+    kref_put(&m->refcount, release_message_slot);
+}
+
+// take a message_slot out of the index. it is freed once the
+// last file using it is closed, until then those files keep working.
+// must be called with message_slot_list_lock held
+void delete_message_slot_from_ptr(struct message_slot *m) {
+    printk("delete message_slot from message_slot index\n");
+    xa_erase(&message_slots, m->device_minor);
+    put_message_slot(m);
+}
+
+void delete_all_channels(struct xarray *channels) {
+    struct channel  *entry = NULL ;
+    unsigned long int channel_id;
+    xa_for_each ( channels, channel_id, entry )
     {
-        // removing message from memory
-        if (entry->length > 0) {
-            kfree(entry->message);
-        }
-        // removing channel from list
-        list_del(&entry->channel_list);
+        // removing message from memory (or just our share of it)
+        put_message_buffer(entry->message);
         // removing channel struct from memory
-        kfree(entry);
+        object_pool_free(&channel_pool, entry);
     }
+    // removing the index itself
+    xa_destroy(channels);
 }
 
+// must be called with message_slot_list_lock held
 struct message_slot *get_message_slot(unsigned long int device_minor) {
-    struct message_slot  *entry = NULL;
-    list_for_each_entry ( entry , & message_slot_list_head, message_slot_list )
-    {
-        if (entry->device_minor == device_minor)
-            return entry;
-    }
+    struct message_slot  *entry = xa_load(&message_slots, device_minor);
+    if (entry != NULL)
+        return entry;
     printk("could not find message_slot %ld\n", device_minor);
     return NULL;
 }
 
-int create_message_slot(unsigned long int device_minor, struct file *file) {
-    struct file_data* file_data;
+// a new, empty message_slot holding the reference of the index.
+// the caller still has to store it in message_slots
+static struct message_slot *alloc_message_slot(unsigned long int device_minor, bool use_arena) {
     struct message_slot *m;
+
+    printk("creating new message_slot for minor %lu\n", device_minor);
+    m = (struct message_slot *) kmalloc(sizeof(struct message_slot), GFP_KERNEL);
+    if (m == NULL) {
+        printk("failed allocating memory to create message_slot\n");
+        return NULL;
+    }
+    m->device_minor = device_minor;
+    m->latency = alloc_percpu(struct latency_hist);
+    if (m->latency == NULL) {
+        printk("failed allocating latency stats for message_slot\n");
+        kfree(m);
+        return NULL;
+    }
+    kref_init(&m->refcount);
+    m->destroyed = false;
+    mutex_init(&m->lock);
+    create_slot_debugfs(m);
+    xa_init(&m->channels); // init channel index
+    m->write_seq = 0;
+    m->ttl = 0;
+    INIT_LIST_HEAD(&m->expiry_list_head);
+    INIT_DELAYED_WORK(&m->reclaim_work, reclaim_expired_messages);
+    m->use_arena = use_arena;
+    init_arena(&m->channel_arena, sizeof(struct channel));
+    init_arena(&m->message_arena, sizeof(struct message_buffer) + MAX_MESSAGE_LENGTH);
+    return m;
+}
+
+// find the message_slot of a minor, creating it on first use.
+// returns it with a reference for the caller, see put_message_slot
+static struct message_slot *get_or_create_message_slot(unsigned long int device_minor) {
+    struct message_slot *m;
+
     printk("get message_slot for minor %lu\n", device_minor);
+    mutex_lock(&message_slot_list_lock);
     // if message_slot already exists no need for that
-    m = get_message_slot(device_minor);
+    m = xa_load(&message_slots, device_minor);
     if (m == NULL) {
-        printk("creating new message_slot for minor %lu\n", device_minor);
-        m = (struct message_slot *) kmalloc(sizeof(struct message_slot), GFP_KERNEL);
+        m = alloc_message_slot(device_minor, READ_ONCE(arena_slots));
         if (m == NULL) {
-            printk("failed allocating memory to create message_slot\n");
-            return -ENOMEM;
+            mutex_unlock(&message_slot_list_lock);
+            return NULL;
+        }
+        // add message_slot to the message_slot index
+        if (xa_err(xa_store(&message_slots, device_minor, m, GFP_KERNEL)) != 0) {
+            mutex_unlock(&message_slot_list_lock);
+            printk("failed adding message_slot %lu to the message_slot index\n", device_minor);
+            put_message_slot(m);
+            return NULL;
         }
-        m->device_minor = device_minor;
-        INIT_LIST_HEAD(&m->channel_list_head); // init channel list
-        list_add(&m->message_slot_list, &message_slot_list_head); // add message_slot to message_slot list
     }
+    kref_get(&m->refcount);
+    mutex_unlock(&message_slot_list_lock);
     printk("created message_slot for minor %lu successfully\n", device_minor);
+    return m;
+}
+
+// a new message_slot with no device node, under the next free id from
+// FIRST_ANONYMOUS_SLOT up. ids are handed out cyclically, so the id of a
+// destroyed slot isn't reused while its debugfs directory may still be
+// around or a monitor still knows it. returns it with a reference for the caller
+static struct message_slot *create_anonymous_message_slot(bool use_arena) {
+    struct message_slot *m = NULL;
+    u32 id;
+
+    mutex_lock(&message_slot_list_lock);
+    // reserve the id first, the slot's debugfs directory is named after it
+    if (xa_alloc_cyclic(&message_slots, &id, NULL, XA_LIMIT(FIRST_ANONYMOUS_SLOT, U32_MAX),
+                        &next_anonymous_slot, GFP_KERNEL) < 0) {
+        mutex_unlock(&message_slot_list_lock);
+        printk("failed allocating an id for a new message_slot\n");
+        return NULL;
+    }
+    m = alloc_message_slot(id, use_arena);
+    if (m == NULL) {
+        xa_release(&message_slots, id);
+    } else {
+        xa_store(&message_slots, id, m, GFP_KERNEL); // the entry exists, this can't fail
+        kref_get(&m->refcount);
+    }
+    mutex_unlock(&message_slot_list_lock);
+    return m;
+}
+
+int create_message_slot(unsigned long int device_minor, struct file *file) {
+    struct file_data* file_data;
+    struct message_slot *m;
 
     printk("creating file_data for new file\n");
-    file_data = (struct file_data*) kmalloc(sizeof(struct file_data), GFP_KERNEL);
+    file_data = (struct file_data*) object_pool_alloc(&file_data_pool);
+    if (file_data == NULL) {
+        printk("failed allocating memory to create file_data\n");
+        return -ENOMEM;
+    }
+
+    // file_data keeps the reference we get with m
+    m = get_or_create_message_slot(device_minor);
+    if (m == NULL) {
+        object_pool_free(&file_data_pool, file_data);
+        return -ENOMEM;
+    }
+
     file_data->message_slot=m;
     file_data->current_channel=NULL;
+    file_data->read_header = false;
     file->private_data = (void*)file_data;
     return SUCCESS;
 }
 
+// must be called with the message_slot lock held
 struct channel* create_channel(unsigned long int channel_id, struct message_slot *m) {
-    struct channel* c = (struct channel *)kmalloc(sizeof(struct channel), GFP_KERNEL);
+    struct channel* c;
+    if (m->use_arena)
+        c = arena_alloc(&m->channel_arena);
+    else
+        c = (struct channel *)object_pool_alloc(&channel_pool);
     if (c == NULL) {
         printk("failed allocating memory to create channel\n");
         return NULL;
     }
     c->channel_id = channel_id;
-    c->message = 0;
-    list_add(&c->channel_list, &m->channel_list_head); // add channel to channel list
+    c->message = NULL;
+    INIT_LIST_HEAD(&c->expiry_list);
+    // add channel to channel index
+    if (xa_err(xa_store(&m->channels, channel_id, c, GFP_KERNEL)) != 0) {
+        printk("failed adding channel %lu to the channel index\n", channel_id);
+        if (m->use_arena)
+            arena_free(&m->channel_arena, c);
+        else
+            object_pool_free(&channel_pool, c);
+        return NULL;
+    }
     printk("created channel for channel id %lu for message_slot ptr %p successfully\n", channel_id, m);
     return c;
 }
 
+// must be called with the message_slot lock held
+static struct channel *get_or_create_channel(unsigned long int channel_id, struct message_slot *m) {
+    struct channel *c = get_channel_from_message_slot_ptr(channel_id, m);
+    if (c == NULL) {
+        printk("no channel has been created on this message_slot for this channel %lu\n", channel_id);
+        c = create_channel(channel_id, m);
+    }
+    return c;
+}
+
 void delete_all_message_slots(void) {
-    struct message_slot *entry, *temp = NULL ;
+    struct message_slot *entry = NULL ;
+    unsigned long int device_minor;
     printk("starting to delete all message_slots\n");
-    list_for_each_entry_safe ( entry , temp, &message_slot_list_head, message_slot_list )
+    mutex_lock(&message_slot_list_lock);
+    xa_for_each ( &message_slots, device_minor, entry )
     {
         delete_message_slot_from_ptr(entry);
     }
+    mutex_unlock(&message_slot_list_lock);
     printk("finished deleting all message slots\n");
 }
 
+//================== JOURNAL ====================================
+// Optional write-behind journal. With journal_path set, every stored
+// message is also appended as a record to an in-memory log, and a work
+// item writes the log out to the backing file in large sequential
+// batches: after journal_flush_ms, or right away once journal_batch_bytes
+// have piled up. Writers never touch the file themselves; they only
+// wait if both log buffers are full, i.e. the disk can't keep up.
+//
+// At load time the file is replayed before the device is registered,
+// recreating slots, channels and messages. For every channel the record
+// with the highest seq wins, and each slot's write_seq continues from
+// there. A torn record at the end (a crash mid-flush) ends the replay
+// and is cut off the file. Whatever was written in the last flush
+// interval before a crash is lost - that is the trade against latency.
+// TTLs are not journaled; replayed messages are stored as new.
+// MSG_SLOT_DESTROY leaves a record with channel id 0 and no message,
+// which deletes the slot again during replay.
+//
+// A write that fails keeps its unwritten records and is retried after
+// journal_flush_ms, before any newer records; writers block once the
+// second buffer fills up behind it. That wait is killable: a killed
+// writer's message stays stored but isn't journaled, and write(2) or
+// MSG_SLOT_BROADCAST fail with the error. message_slot/journal_write_errors
+// counts the failed writes.
+//
+// With journal_compact set, the replayed state is written back as one
+// record per channel holding a message, so the file doesn't grow
+// forever. The snapshot is first written and synced to
+// <journal_path>.compact, then the journal is rewritten from it and the
+// copy is emptied and that is synced too, all before the journal takes
+// its first new record. So a copy found non-empty at load only holds
+// (a prefix of) the very state the journal held when it was made: it
+// is replayed after the journal, which changes nothing if the journal
+// was complete and restores what a crash in the rewrite cut off, and
+// then compacted again. Replaying a copy older than the journal would
+// not be harmless, since seqs restart when a slot is destroyed and
+// created again.
+
+static char *journal_path;
+module_param(journal_path, charp, 0444);
+MODULE_PARM_DESC(journal_path, "backing file of the write-behind journal, unset to keep messages in memory only");
+
+static unsigned int journal_flush_ms = 1000;
+module_param(journal_flush_ms, uint, 0644);
+MODULE_PARM_DESC(journal_flush_ms, "longest time a journal record waits before it is written out");
+
+static unsigned int journal_batch_bytes = 64 * 1024;
+module_param(journal_batch_bytes, uint, 0444);
+MODULE_PARM_DESC(journal_batch_bytes, "write the journal out once this much is pending");
+
+static bool journal_sync;
+module_param(journal_sync, bool, 0644);
+MODULE_PARM_DESC(journal_sync, "fdatasync the journal file after every flush");
+
+static bool journal_compact = true;
+module_param(journal_compact, bool, 0444);
+MODULE_PARM_DESC(journal_compact, "rewrite the journal at load time with only the newest message of each channel");
+
+#define JOURNAL_MAGIC 0x4a4c534d // "MSLJ"
+
+// on disk, in host byte order, followed by length bytes of message.
+// crc covers the record with crc set to 0, and the message.
+// channel_id 0 marks the destruction of a slot
+struct journal_record {
+    __u32 magic;
+    __u32 length;
+    __u64 device_minor;
+    __u64 channel_id;
+    __u64 seq;
+    __u64 timestamp;
+    __u32 crc;
+    __u32 reserved;
+};
+
+#define JOURNAL_RECORD_MAX (sizeof(struct journal_record) + MAX_MESSAGE_LENGTH)
+#define JOURNAL_READ_SIZE (256 * 1024) // replay reads the file in chunks this big
+
+static struct {
+    struct file *file;       // NULL when journaling is off
+    spinlock_t lock;         // protects buf, used and every message_slot's destroyed
+    char *buf;               // records not yet handed to the flush work
+    char *flush_buf;         // records being written out, only used by the flush work
+    size_t used;
+    size_t size;             // of each buffer
+    size_t batch;
+    size_t flush_length;     // bytes in flush_buf
+    size_t flush_done;       // of which already in the file
+    u64 write_errors;        // failed writes to the file
+    wait_queue_head_t space; // writers waiting for buf to have room
+    struct delayed_work flush_work;
+} journal;
+
+static u32 journal_record_crc(struct journal_record *r, const char *data) {
+    u32 crc, saved = r->crc;
+    r->crc = 0;
+    crc = crc32(~0, r, sizeof(*r));
+    crc = crc32(crc, data, r->length);
+    r->crc = saved;
+    return crc;
+}
+
+static bool journal_has_room(size_t length) {
+    bool room;
+    spin_lock(&journal.lock);
+    room = journal.used + length <= journal.size;
+    spin_unlock(&journal.lock);
+    return room;
+}
+
+// write all of data at the end of file
+static int journal_write(struct file *file, const char *data, size_t length, size_t *done) {
+    ssize_t ret;
+    loff_t pos;
+
+    while (*done < length) {
+        pos = 0; // the file is O_APPEND
+        ret = kernel_write(file, data + *done, length - *done, &pos);
+        if (ret <= 0)
+            return ret < 0 ? ret : -EIO;
+        *done += ret;
+    }
+    return SUCCESS;
+}
+
+// write out what is left of flush_buf; on failure the rest stays there
+static int write_flush_buf(void) {
+    int rc = journal_write(journal.file, journal.flush_buf, journal.flush_length, &journal.flush_done);
+    if (rc != SUCCESS) {
+        journal.write_errors++;
+        printk_ratelimited("failed writing %zu bytes to the journal: %d\n",
+                           journal.flush_length - journal.flush_done, rc);
+    }
+    return rc;
+}
+
+// finish what a failed write left behind, then swap in the pending
+// records and write those. only called by the flush work, or once it
+// can't run anymore
+static int write_journal(void) {
+    char *data;
+    int rc;
+
+    rc = write_flush_buf();
+    if (rc != SUCCESS)
+        return rc;
+
+    spin_lock(&journal.lock);
+    data = journal.buf;
+    journal.buf = journal.flush_buf;
+    journal.flush_buf = data;
+    journal.flush_length = journal.used;
+    journal.flush_done = 0;
+    journal.used = 0;
+    spin_unlock(&journal.lock);
+    wake_up_all(&journal.space);
+
+    rc = write_flush_buf();
+    if (rc == SUCCESS && journal.flush_length > 0 && journal_sync)
+        vfs_fsync(journal.file, 1);
+    return rc;
+}
+
+// hand the pending records to the flush work, which runs on its own
+// so there is always a free buffer to append to while it writes.
+// records a failed write couldn't get out stay in flush_buf and go
+// first on the retry
+static void flush_journal(struct work_struct *work) {
+    if (write_journal() != SUCCESS)
+        schedule_delayed_work(&journal.flush_work, msecs_to_jiffies(journal_flush_ms));
+}
+
+// append r and its message to the log, unless r is about a
+// destroyed slot and destroying is false.
+// may wait for the flush work, so no spinning lock may be held.
+// returns -ERESTARTSYS if the caller was killed while waiting
+static int journal_append_record(struct message_slot *m, struct journal_record *r, const char *data,
+                                 bool destroying) {
+    size_t length = sizeof(*r) + r->length;
+    bool first, full;
+
+    r->magic = JOURNAL_MAGIC;
+    r->device_minor = m->device_minor;
+    r->crc = journal_record_crc(r, data);
+
+    spin_lock(&journal.lock);
+    while (journal.used + length > journal.size) {
+        spin_unlock(&journal.lock);
+        mod_delayed_work(system_wq, &journal.flush_work, 0);
+        if (wait_event_killable(journal.space, journal_has_room(length)) != 0)
+            return -ERESTARTSYS;
+        spin_lock(&journal.lock);
+    }
+    // checked under the same lock as the destroy record is appended, so
+    // no message of a destroyed slot ends up after it in the journal
+    if (m->destroyed && !destroying) {
+        spin_unlock(&journal.lock);
+        return SUCCESS;
+    }
+    m->destroyed = destroying;
+    memcpy(journal.buf + journal.used, r, sizeof(*r));
+    memcpy(journal.buf + journal.used + sizeof(*r), data, r->length);
+    journal.used += length;
+    first = journal.used == length;
+    full = journal.used >= journal.batch;
+    spin_unlock(&journal.lock);
+
+    if (full)
+        mod_delayed_work(system_wq, &journal.flush_work, 0);
+    else if (first)
+        schedule_delayed_work(&journal.flush_work, msecs_to_jiffies(journal_flush_ms));
+    return SUCCESS;
+}
+
+// append a record for a message just stored in a channel.
+// must be called without the message_slot lock held, since it may wait
+// for the flush work; the seq in b still orders the records
+static int journal_append(struct message_slot *m, unsigned long int channel_id, struct message_buffer *b) {
+    struct journal_record r;
+
+    if (journal.file == NULL)
+        return SUCCESS;
+    memset(&r, 0, sizeof(r));
+    r.length = b->length;
+    r.channel_id = channel_id;
+    r.seq = b->seq;
+    r.timestamp = b->timestamp;
+    return journal_append_record(m, &r, b->data, false);
+}
+
+// record that a slot was destroyed. messages written to it
+// afterwards through files still open are no longer journaled
+static int journal_destroy(struct message_slot *m) {
+    struct journal_record r;
+
+    if (journal.file == NULL)
+        return SUCCESS;
+    memset(&r, 0, sizeof(r));
+    return journal_append_record(m, &r, NULL, true);
+}
+
+// store one replayed record unless its channel already holds a newer message
+static int journal_replay_record(const struct journal_record *r, const char *data) {
+    struct message_slot *m;
+    struct message_buffer *b;
+    struct channel *c;
+
+    if (r->device_minor > ULONG_MAX || r->channel_id > ULONG_MAX)
+        return -EINVAL;
+    if (r->channel_id == 0) {
+        if (r->length != 0)
+            return -EINVAL;
+        mutex_lock(&message_slot_list_lock);
+        m = xa_load(&message_slots, r->device_minor);
+        if (m != NULL)
+            delete_message_slot_from_ptr(m);
+        mutex_unlock(&message_slot_list_lock);
+        return SUCCESS;
+    }
+    if (r->length == 0)
+        return -EINVAL;
+    m = get_or_create_message_slot(r->device_minor);
+    if (m == NULL)
+        return -ENOMEM;
+    b = alloc_message_buffer(m, r->length);
+    if (b == NULL) {
+        put_message_slot(m);
+        return -ENOMEM;
+    }
+    memcpy(b->data, data, r->length);
+
+    mutex_lock(&m->lock);
+    c = get_or_create_channel(r->channel_id, m);
+    if (c != NULL && (c->message == NULL || c->message->seq < r->seq)) {
+        b->written = jiffies;
+        b->timestamp = r->timestamp;
+        // the monotonic clock and pids don't survive a reboot
+        b->write_time = 0;
+        b->writer_pid = NULL;
+        b->seq = r->seq;
+        set_channel_message(m, c, b);
+    }
+    m->write_seq = max(m->write_seq, r->seq);
+    mutex_unlock(&m->lock);
+    put_message_buffer(b);
+    put_message_slot(m);
+    return c == NULL ? -ENOMEM : SUCCESS;
+}
+
+// returns the number of bytes of valid records, which is where
+// the journal continues, or a negative error.
+// the file is read in large chunks and the records parsed from memory
+static loff_t replay_journal(struct file *file, const char *path) {
+    struct journal_record r;
+    char *buf, *data;
+    size_t have = 0, off = 0;
+    loff_t pos = 0, read_pos = 0;
+    unsigned long records = 0;
+    bool eof = false;
+    ssize_t ret;
+    int rc = SUCCESS;
+
+    buf = kvmalloc(JOURNAL_READ_SIZE, GFP_KERNEL);
+    if (buf == NULL)
+        return -ENOMEM;
+    for (;;) {
+        // keep at least one whole record in the buffer until the end of the file
+        if (have - off < JOURNAL_RECORD_MAX && !eof) {
+            memmove(buf, buf + off, have - off);
+            have -= off;
+            off = 0;
+            ret = kernel_read(file, buf + have, JOURNAL_READ_SIZE - have, &read_pos);
+            if (ret < 0) {
+                rc = ret;
+                break;
+            }
+            eof = ret == 0;
+            have += ret;
+            continue;
+        }
+        if (have - off < sizeof(r))
+            break;
+        memcpy(&r, buf + off, sizeof(r));
+        if (r.magic != JOURNAL_MAGIC || r.length > MAX_MESSAGE_LENGTH || have - off < sizeof(r) + r.length)
+            break;
+        data = buf + off + sizeof(r);
+        if (journal_record_crc(&r, data) != r.crc)
+            break;
+        rc = journal_replay_record(&r, data);
+        if (rc != SUCCESS)
+            break;
+        off += sizeof(r) + r.length;
+        pos += sizeof(r) + r.length;
+        ++records;
+    }
+    kvfree(buf);
+    if (rc != SUCCESS) {
+        printk("failed replaying journal record %lu of %s\n", records, path);
+        return rc;
+    }
+    printk("replayed %lu journal records from %s\n", records, path);
+    return pos;
+}
+
+// append one record for every channel holding a message to file,
+// staged in journal.buf. runs before the device is registered
+static int write_journal_snapshot(struct file *file) {
+    struct journal_record r;
+    struct message_slot *m;
+    struct message_buffer *b;
+    struct channel *c;
+    unsigned long int id, channel_id;
+    size_t used = 0, done;
+    int rc = SUCCESS;
+
+    mutex_lock(&message_slot_list_lock);
+    xa_for_each(&message_slots, id, m) {
+        mutex_lock(&m->lock);
+        xa_for_each(&m->channels, channel_id, c) {
+            b = c->message;
+            if (b == NULL)
+                continue;
+            if (used + JOURNAL_RECORD_MAX > journal.size) {
+                done = 0;
+                rc = journal_write(file, journal.buf, used, &done);
+                if (rc != SUCCESS)
+                    break;
+                used = 0;
+            }
+            memset(&r, 0, sizeof(r));
+            r.magic = JOURNAL_MAGIC;
+            r.length = b->length;
+            r.device_minor = id;
+            r.channel_id = channel_id;
+            r.seq = b->seq;
+            r.timestamp = b->timestamp;
+            r.crc = journal_record_crc(&r, b->data);
+            memcpy(journal.buf + used, &r, sizeof(r));
+            memcpy(journal.buf + used + sizeof(r), b->data, r.length);
+            used += sizeof(r) + r.length;
+        }
+        mutex_unlock(&m->lock);
+        if (rc != SUCCESS)
+            break;
+    }
+    mutex_unlock(&message_slot_list_lock);
+
+    done = 0;
+    if (rc == SUCCESS)
+        rc = journal_write(file, journal.buf, used, &done);
+    if (rc == SUCCESS)
+        rc = vfs_fsync(file, 0);
+    return rc;
+}
+
+// rewrite the journal as a snapshot of what was just replayed,
+// going through a synced copy at compact_path, see above
+static int compact_journal(struct file *file, const char *compact_path) {
+    struct file *compact;
+    int rc;
+
+    compact = filp_open(compact_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_LARGEFILE, 0600);
+    if (IS_ERR(compact)) {
+        printk("failed opening %s\n", compact_path);
+        return PTR_ERR(compact);
+    }
+    rc = write_journal_snapshot(compact);
+    if (rc == SUCCESS)
+        rc = vfs_truncate(&file->f_path, 0);
+    if (rc == SUCCESS)
+        rc = write_journal_snapshot(file);
+    if (rc == SUCCESS)
+        rc = vfs_truncate(&compact->f_path, 0);
+    // an emptied copy that isn't on disk yet could come back after a crash
+    if (rc == SUCCESS)
+        rc = vfs_fsync(compact, 0);
+    filp_close(compact, NULL);
+    if (rc != SUCCESS)
+        printk("failed compacting journal %s: %d\n", journal_path, rc);
+    else
+        printk("compacted journal %s to %lld bytes\n", journal_path, i_size_read(file_inode(file)));
+    return rc;
+}
+
+// replay what an interrupted compaction left at compact_path.
+// returns 1 if there was anything, 0 if not, or a negative error
+static int replay_compact_journal(const char *compact_path) {
+    struct file *compact;
+    loff_t end;
+
+    compact = filp_open(compact_path, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(compact))
+        return PTR_ERR(compact) == -ENOENT ? 0 : PTR_ERR(compact);
+    end = i_size_read(file_inode(compact)) == 0 ? 0 : replay_journal(compact, compact_path);
+    filp_close(compact, NULL);
+    if (end < 0)
+        return end;
+    return end > 0;
+}
+
+static void close_journal(void) {
+    if (journal.file == NULL)
+        return;
+    // no more writers, write out whatever is left
+    cancel_delayed_work_sync(&journal.flush_work);
+    if (write_journal() != SUCCESS)
+        printk("lost %zu bytes of journal records\n",
+               journal.flush_length - journal.flush_done + journal.used);
+    vfs_fsync(journal.file, 1);
+    filp_close(journal.file, NULL);
+    journal.file = NULL;
+    kvfree(journal.buf);
+    kvfree(journal.flush_buf);
+    journal.buf = NULL;
+    journal.flush_buf = NULL;
+}
+
+static int open_journal(void) {
+    struct file *file;
+    char *compact_path;
+    loff_t end;
+    int rc;
+
+    if (journal_path == NULL || journal_path[0] == '\0')
+        return SUCCESS;
+
+    // both buffers hold a full batch plus the record that crosses it
+    journal.batch = clamp_t(size_t, journal_batch_bytes, JOURNAL_RECORD_MAX, SZ_64M);
+    journal.size = journal.batch + JOURNAL_RECORD_MAX;
+    journal.used = 0;
+    journal.flush_length = 0;
+    journal.flush_done = 0;
+    journal.write_errors = 0;
+    spin_lock_init(&journal.lock);
+    init_waitqueue_head(&journal.space);
+    INIT_DELAYED_WORK(&journal.flush_work, flush_journal);
+    journal.buf = kvmalloc(journal.size, GFP_KERNEL);
+    journal.flush_buf = kvmalloc(journal.size, GFP_KERNEL);
+    compact_path = kasprintf(GFP_KERNEL, "%s.compact", journal_path);
+    if (journal.buf == NULL || journal.flush_buf == NULL || compact_path == NULL) {
+        printk("failed allocating journal buffers\n");
+        rc = -ENOMEM;
+        goto fail;
+    }
+
+    file = filp_open(journal_path, O_RDWR | O_CREAT | O_APPEND | O_LARGEFILE, 0600);
+    if (IS_ERR(file)) {
+        printk("failed opening journal %s\n", journal_path);
+        rc = PTR_ERR(file);
+        goto fail;
+    }
+
+    end = replay_journal(file, journal_path);
+    rc = end < 0 ? end : replay_compact_journal(compact_path);
+    if (rc < 0) {
+        filp_close(file, NULL);
+        goto fail;
+    }
+    if (journal_compact || rc > 0) {
+        // a leftover copy is only gone once a compaction went through
+        rc = compact_journal(file, compact_path);
+    } else if (end < i_size_read(file_inode(file))) {
+        // drop a torn tail so new records follow the last good one
+        printk("truncating journal %s to %lld bytes\n", journal_path, end);
+        rc = vfs_truncate(&file->f_path, end);
+    }
+    if (rc != SUCCESS) {
+        filp_close(file, NULL);
+        goto fail;
+    }
+    kfree(compact_path);
+    debugfs_create_u64("journal_write_errors", 0444, debugfs_root, &journal.write_errors);
+    journal.file = file;
+    return SUCCESS;
+
+fail:
+    kfree(compact_path);
+    kvfree(journal.buf);
+    kvfree(journal.flush_buf);
+    journal.buf = NULL;
+    journal.flush_buf = NULL;
+    return rc;
+}
+
 
 //================== DEVICE FUNCTIONS ===========================
+static struct message_slot *file_message_slot(struct file *file) {
+    struct file_data *file_data = (struct file_data*) file->private_data;
+    return file_data == NULL ? NULL : file_data->message_slot;
+}
+
+//---------------------------------------------------------------
 static int device_open( struct inode* inode,
                         struct file*  file )
 {
     unsigned long int minor;
     int status;
+    u64 start = latency_start();
     minor = iminor(inode);
     printk("opening message_slot for minor %lu\n", minor);
     status = create_message_slot(minor, file);
     if (status == SUCCESS) {
+        latency_record(file_message_slot(file), SLOT_OP_OPEN, start);
         printk("opened device for minor %lu successfully\n", minor);
         return SUCCESS;
     }
@@ -166,22 +1376,36 @@ static int device_open( struct inode* inode,
 }
 
 //---------------------------------------------------------------
+// also releases the fds made by the control device, whose
+// inode is anonymous, so the minor comes from the message_slot
 static int device_release( struct inode* inode, struct file*  file) {
+    struct message_slot *m = file_message_slot(file);
     unsigned long int minor;
-    minor = iminor(inode);
+    minor = m->device_minor;
     printk("realising device for minor %lu\n", minor);
-    kfree(file->private_data);
+    object_pool_free(&file_data_pool, file->private_data);
+    put_message_slot(m);
     printk("realised device for minor %lu\n", minor);
     return SUCCESS;
 }
 
 //---------------------------------------------------------------
 // a process which has already opened
-// the device file attempts to read from it
-static ssize_t device_read( struct file* file, char __user* buffer, size_t length, loff_t* offset ) {
+// the device file attempts to read from it.
+// read(2), readv(2) and splice_read all land here, so the message
+// is copied straight into whatever the iterator describes
+// (user buffer or pipe pages) without an intermediate bounce buffer.
+// with MSG_SLOT_READ_HEADER set the message is preceded by its header
+static ssize_t __device_read_iter( struct kiocb* iocb, struct iov_iter* to ) {
+    struct file *file = iocb->ki_filp;
     struct channel *c;
     struct file_data *file_data;
+    struct message_buffer *b;
+    struct message_slot_header header;
     unsigned long int channel_id, device_minor;
+    size_t length = iov_iter_count(to);
+    size_t header_length;
+    ssize_t ret;
 
     printk("trying to read from message_slot\n");
 
@@ -205,44 +1429,75 @@ static ssize_t device_read( struct file* file, char __user* buffer, size_t lengt
 
     printk("reading from message_slot with minor %lu for channel %lu\n", device_minor, channel_id);
 
-    if (c->length <= 0) {
+    // take our own reference so the copy below can run
+    // without the lock even if a writer replaces the message
+    mutex_lock(&file_data->message_slot->lock);
+    b = channel_message(file_data->message_slot, c);
+    if (b != NULL)
+        kref_get(&b->refcount);
+    mutex_unlock(&file_data->message_slot->lock);
+
+    if (b == NULL) {
         // no message in channel
         printk("no message in channel for message_slot with minor %lu channel %lu\n", device_minor, channel_id);
         return -EWOULDBLOCK;
     }
 
-    if (c->length > length) {
+    header_length = file_data->read_header ? sizeof(header) : 0;
+    if (header_length + b->length > length) {
         // the buffer provided is too small
         printk("the buffer provided is too small for device minor %lu channel %lu\n", device_minor, channel_id);
+        put_message_buffer(b);
         return -ENOSPC;
     }
 
+    if (file_data->read_header) {
+        memset(&header, 0, sizeof(header));
+        header.sequence = b->seq;
+        header.write_time_ns = b->write_time;
+        header.write_realtime_ns = b->timestamp;
+        header.writer_pid = pid_vnr(b->writer_pid);
+        header.length = b->length;
+        if (copy_to_iter(&header, sizeof(header), to) != sizeof(header)) {
+            printk("failed writing message header to buffer\n");
+            put_message_buffer(b);
+            return -EIO;
+        }
+    }
+
     printk("writing message to buffer\n");
-    if (copy_to_user(buffer, c->message, c->length) != 0) {
+    if (copy_to_iter(b->data, b->length, to) != b->length) {
         printk("failed writing message to buffer\n");
+        put_message_buffer(b);
         return -EIO;
     }
 
-    printk("read message of length %ld for message_slot with minor %lu channel %lu\n", c->length, device_minor, channel_id);
+    // the position of a message slot fd is the sequence of the last
+    // message it handed over, which device_splice_read compares against
+    iocb->ki_pos = b->seq;
+    ret = header_length + b->length;
+    put_message_buffer(b);
+    printk("read message of length %ld for message_slot with minor %lu channel %lu\n", ret, device_minor, channel_id);
 
     // return the number of output characters used
-    return c->length;
+    return ret;
 }
 
 //---------------------------------------------------------------
 // a process which has already opened
-// the device file attempts to write to it
-static ssize_t device_write( struct file*       file,
-        const char __user* buffer,
-        size_t             length,
-        loff_t*            offset)
+// the device file attempts to write to it.
+// write(2), writev(2) and splice_write all land here; the whole
+// iterator is taken as one message
+static ssize_t __device_write_iter( struct kiocb* iocb, struct iov_iter* from )
 {
+    struct file *file = iocb->ki_filp;
     unsigned long int channel_id;
     unsigned long int device_minor;
     struct channel *c;
     struct file_data *file_data;
-    ssize_t i;
-    char temp_buffer[MAX_MESSAGE_LENGTH];
+    size_t length = iov_iter_count(from);
+    struct message_buffer *b;
+    int rc;
 
     printk("trying to write to device\n");
 
@@ -274,77 +1529,350 @@ static ssize_t device_write( struct file*       file,
         printk("max message size\n");
         return -EMSGSIZE;
     }
-    if (buffer == NULL) {
+    if (iter_has_null_buffer(from)) {
         // buffer is empty
         printk("buffer is empty\n");
         return -EINVAL;
     }
 
-    // delete previous message
-    if (c->length != 0) {
-        printk("delete previous message\n");
-        c->length = 0;
-        kfree(c->message);
+    b = alloc_message_buffer(file_data->message_slot, length);
+    if (b == NULL) {
+        return -ENOMEM;
     }
 
+    // copy straight into the new message, so a failed copy
+    // leaves the previous message in place
     printk("reading message from buffer\n");
-    if (copy_from_user(temp_buffer, buffer, length) != 0) {
+    if (copy_from_iter(b->data, length, from) != length) {
         printk("failed reading message from buffer\n");
+        put_message_buffer(b);
         return -EIO;
     }
 
-    c->message = (char *)kmalloc(sizeof(char) * (length), GFP_KERNEL);
-    if (c->message == NULL) {
-        printk("failed allocating memory for message\n");
-        return -ENOMEM;
-    }
-
-    printk("writing message from temp buffer to message slot\n");
-    for( i = 0; i < length; ++i ) {
-        c->message[i] = temp_buffer[i];
-    }
+    // replace previous message
+    mutex_lock(&file_data->message_slot->lock);
+    stamp_message(file_data->message_slot, b);
+    set_channel_message(file_data->message_slot, c, b);
+    mutex_unlock(&file_data->message_slot->lock);
+    rc = journal_append(file_data->message_slot, channel_id, b);
+    put_message_buffer(b);
+    if (rc != SUCCESS)
+        return rc;
 
-    c->length = length;
     printk("wrote to device message of length %ld\n", length);
     // return the number of input characters used
     return length;
 }
 
+static ssize_t device_read_iter( struct kiocb* iocb, struct iov_iter* to ) {
+    u64 start = latency_start();
+    ssize_t ret = __device_read_iter(iocb, to);
+    latency_record(file_message_slot(iocb->ki_filp), SLOT_OP_READ, start);
+    return ret;
+}
+
+static ssize_t device_write_iter( struct kiocb* iocb, struct iov_iter* from ) {
+    u64 start = latency_start();
+    ssize_t ret = __device_write_iter(iocb, from);
+    latency_record(file_message_slot(iocb->ki_filp), SLOT_OP_WRITE, start);
+    return ret;
+}
+
+//---------------------------------------------------------------
+// splice a message from a channel into a pipe.
+// a channel holds one message, not a byte stream, so *ppos holds the
+// sequence of the last message handed over rather than a byte offset.
+// the current message is spliced whole unless its sequence equals
+// *ppos, in which case we report end of data. This keeps sendfile(2),
+// which keeps splicing until it sees 0, from forwarding the same
+// message twice, while a relay splicing with a NULL offset forwards
+// every new message once. sequences start at 1, so an explicit zero
+// offset always forwards the current message. a broadcast stores one
+// sequence in several channels, so MSG_SLOT_CHANNEL resets the position
+// whenever it switches the fd to another channel
+static ssize_t device_splice_read( struct file* in, loff_t* ppos,
+                                   struct pipe_inode_info* pipe,
+                                   size_t length, unsigned int flags )
+{
+    struct file_data *file_data = in->private_data;
+    struct message_slot *m;
+    struct message_buffer *b;
+    loff_t pos = 0;
+    ssize_t ret;
+
+    if (file_data != NULL && file_data->current_channel != NULL) {
+        m = file_data->message_slot;
+        mutex_lock(&m->lock);
+        b = channel_message(m, file_data->current_channel);
+        if (b != NULL && b->seq == *ppos) {
+            mutex_unlock(&m->lock);
+            return 0;
+        }
+        mutex_unlock(&m->lock);
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    ret = copy_splice_read(in, &pos, pipe, length, flags);
+#else
+    ret = generic_file_splice_read(in, &pos, pipe, length, flags);
+#endif
+    if (ret > 0)
+        *ppos = pos;
+    return ret;
+}
+
 //----------------------------------------------------------------
-static long device_ioctl(struct file* file, unsigned int ioctl_command_id, unsigned long ioctl_param) {
+// MSG_SLOT_CHANNEL: select the channel used by read and write
+static long set_channel(struct file_data *file_data, unsigned long int channel_id) {
     struct message_slot *m;
     struct channel *c;
-    struct file_data *file_data;
+
+    if (file_data->current_channel == NULL || file_data->current_channel->channel_id != channel_id) {
+        m = file_data->message_slot;
+        mutex_lock(&m->lock);
+        c = get_or_create_channel(channel_id, m);
+        mutex_unlock(&m->lock);
+        if (c == NULL) {
+            printk("failed to create channel for this message_slot for this channel %lu\n", channel_id);
+            return -ENOMEM;
+        }
+        file_data->current_channel=c;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------
+// MSG_SLOT_BROADCAST: write one message to several channels.
+// the payload is copied from userspace once and the same
+// message_buffer is shared by every target channel
+static long broadcast_message(struct file_data *file_data, unsigned long ioctl_param) {
+    struct message_slot_broadcast request;
+    struct message_slot *m = file_data->message_slot;
+    struct message_buffer *b;
+    struct channel **channels;
+    __u64 *channel_ids;
+    unsigned int i;
+    long status = SUCCESS;
+
+    if (copy_from_user(&request, (void __user *)ioctl_param, sizeof(request)) != 0) {
+        printk("failed reading broadcast request\n");
+        return -EFAULT;
+    }
+    if (request.num_channels == 0 || request.num_channels > MAX_BROADCAST_CHANNELS) {
+        printk("invalid number of channels for broadcast %u\n", request.num_channels);
+        return -EINVAL;
+    }
+    if (request.length == 0 || request.length > MAX_MESSAGE_LENGTH) {
+        printk("max message size\n");
+        return -EMSGSIZE;
+    }
+
+    channel_ids = memdup_user(u64_to_user_ptr(request.channel_ids), sizeof(__u64) * request.num_channels);
+    if (IS_ERR(channel_ids)) {
+        printk("failed reading broadcast channel ids\n");
+        return PTR_ERR(channel_ids);
+    }
+    for (i = 0; i < request.num_channels; ++i) {
+        if (channel_ids[i] == 0 || channel_ids[i] > ULONG_MAX) {
+            printk("invalid channel id in broadcast\n");
+            kfree(channel_ids);
+            return -EINVAL;
+        }
+    }
+
+    channels = kmalloc_array(request.num_channels, sizeof(*channels), GFP_KERNEL);
+    b = alloc_message_buffer(m, request.length);
+    if (channels == NULL || b == NULL) {
+        status = -ENOMEM;
+        goto out;
+    }
+    if (copy_from_user(b->data, u64_to_user_ptr(request.message), request.length) != 0) {
+        printk("failed reading message from buffer\n");
+        status = -EFAULT;
+        goto out;
+    }
+
+    // resolve every channel before touching any message, so a
+    // failed broadcast never leaves only some channels updated
+    mutex_lock(&m->lock);
+    for (i = 0; i < request.num_channels; ++i) {
+        channels[i] = get_or_create_channel(channel_ids[i], m);
+        if (channels[i] == NULL) {
+            printk("failed to create channel for this message_slot for this channel %llu\n", channel_ids[i]);
+            status = -ENOMEM;
+            break;
+        }
+    }
+    if (status == SUCCESS) {
+        stamp_message(m, b);
+        for (i = 0; i < request.num_channels; ++i)
+            set_channel_message(m, channels[i], b);
+    }
+    mutex_unlock(&m->lock);
+    for (i = 0; status == SUCCESS && i < request.num_channels; ++i)
+        status = journal_append(m, channel_ids[i], b);
+    printk("broadcast message of length %u to %u channels\n", request.length, request.num_channels);
+
+out:
+    put_message_buffer(b);
+    kfree(channels);
+    kfree(channel_ids);
+    return status;
+}
+
+//----------------------------------------------------------------
+// MSG_SLOT_SET_TTL: set how long messages of this message_slot live.
+// the new TTL also applies to messages already stored
+static long set_ttl(struct file_data *file_data, unsigned long ttl_ms) {
+    struct message_slot *m = file_data->message_slot;
+
+    if (ttl_ms > UINT_MAX) {
+        printk("ttl of %lu ms is too long\n", ttl_ms);
+        return -EINVAL;
+    }
+    mutex_lock(&m->lock);
+    m->ttl = ttl_ms == 0 ? 0 : max(msecs_to_jiffies(ttl_ms), 1UL);
+    mutex_unlock(&m->lock);
+    // let the reclaimer look at the slot again under the new TTL
+    mod_delayed_work(system_wq, &m->reclaim_work, 0);
+    printk("set ttl of message_slot with minor %lu to %lu ms\n", m->device_minor, ttl_ms);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------
+// MSG_SLOT_LIST_CHANNELS: report channels in channel id order.
+// the slot lock is only held for LIST_CHANNELS_BATCH channels at a
+// time, so a sweep over a huge slot never holds up writers for long
+#define LIST_CHANNELS_BATCH 64
+
+// fill info with up to max channels starting at *channel_id, and
+// leave *channel_id at the next channel to report. returns how many
+// were filled in; *done is set once there is nothing left after them
+static unsigned int collect_channel_info(struct message_slot *m, unsigned long int *channel_id,
+                                         struct message_slot_channel_info *info, unsigned int max, bool *done) {
+    struct message_buffer *b;
+    struct channel *c;
+    unsigned int n = 0;
+
+    memset(info, 0, sizeof(*info) * max);
+    mutex_lock(&m->lock);
+    for (c = xa_find(&m->channels, channel_id, ULONG_MAX, XA_PRESENT);
+         c != NULL && n < max;
+         c = xa_find_after(&m->channels, channel_id, ULONG_MAX, XA_PRESENT)) {
+        info[n].channel_id = *channel_id;
+        b = channel_message(m, c);
+        if (b != NULL) {
+            info[n].sequence = b->seq;
+            info[n].write_time_ns = b->timestamp;
+            info[n].length = b->length;
+        }
+        ++n;
+    }
+    mutex_unlock(&m->lock);
+    *done = c == NULL;
+    return n;
+}
+
+static long list_channels(struct file_data *file_data, unsigned long ioctl_param) {
+    struct message_slot_list_channels request;
+    struct message_slot_channel_info __user *out;
+    struct message_slot_channel_info *info;
     unsigned long int channel_id;
-    // Switch channel according to the ioctl called
-    printk("ioctl was invoked\n");
-    if( MSG_SLOT_CHANNEL != ioctl_command_id || ioctl_param == 0 ) {
-        printk("failed in ioctl for incorrect input\n");
+    unsigned int n;
+    bool done = false;
+
+    if (copy_from_user(&request, (void __user *)ioctl_param, sizeof(request)) != 0) {
+        printk("failed reading list channels request\n");
+        return -EFAULT;
+    }
+    if (request.cursor > ULONG_MAX) {
+        printk("invalid list channels cursor\n");
         return -EINVAL;
     }
 
-    // Get the parameter given to ioctl by the process
-    channel_id = ioctl_param;
+    info = kmalloc_array(LIST_CHANNELS_BATCH, sizeof(*info), GFP_KERNEL);
+    if (info == NULL) {
+        return -ENOMEM;
+    }
+
+    out = u64_to_user_ptr(request.channels);
+    channel_id = request.cursor;
+    request.num_channels = 0;
+    while (request.num_channels < request.max_channels && !done) {
+        n = collect_channel_info(file_data->message_slot, &channel_id, info,
+                                 min_t(unsigned int, LIST_CHANNELS_BATCH, request.max_channels - request.num_channels),
+                                 &done);
+        if (copy_to_user(out + request.num_channels, info, sizeof(*info) * n) != 0) {
+            kfree(info);
+            printk("failed writing channel list\n");
+            return -EFAULT;
+        }
+        request.num_channels += n;
+    }
+    kfree(info);
+
+    request.cursor = done ? 0 : channel_id;
+    if (copy_to_user((void __user *)ioctl_param, &request, sizeof(request)) != 0) {
+        printk("failed writing list channels result\n");
+        return -EFAULT;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------
+static long __device_ioctl(struct file* file, unsigned int ioctl_command_id, unsigned long ioctl_param) {
+    struct file_data *file_data;
+    struct channel *c;
+    long status;
+    printk("ioctl was invoked\n");
+
     file_data = (struct file_data*) file->private_data;
     if (file_data == NULL || file_data->message_slot == NULL) {
         printk("file_data is not set for file descriptor\n");
         return -EINVAL;
     }
-    if (file_data->current_channel == NULL || file_data->current_channel->channel_id != channel_id) {
-        m = file_data->message_slot;
-        c = get_channel_from_message_slot_ptr(channel_id, m);
-        if (c == NULL) {
-            printk("no channel has been created on this message_slot for this channel %lu\n", channel_id);
-            c = create_channel(channel_id, m);
-            if (c == NULL) {
-                printk("failed to create channel for this message_slot for this channel %lu\n", channel_id);
-                return -ENOMEM;
-            }
+
+    switch (ioctl_command_id) {
+    case MSG_SLOT_CHANNEL:
+        // Get the parameter given to ioctl by the process
+        if (ioctl_param == 0) {
+            printk("failed in ioctl for incorrect input\n");
+            return -EINVAL;
         }
-        file_data->current_channel=c;
+        c = file_data->current_channel;
+        status = set_channel(file_data, ioctl_param);
+        // nothing of the new channel has been spliced yet
+        if (status == SUCCESS && file_data->current_channel != c)
+            file->f_pos = 0;
+        break;
+    case MSG_SLOT_BROADCAST:
+        status = broadcast_message(file_data, ioctl_param);
+        break;
+    case MSG_SLOT_SET_TTL:
+        status = set_ttl(file_data, ioctl_param);
+        break;
+    case MSG_SLOT_LIST_CHANNELS:
+        status = list_channels(file_data, ioctl_param);
+        break;
+    case MSG_SLOT_READ_HEADER:
+        file_data->read_header = ioctl_param != 0;
+        status = SUCCESS;
+        break;
+    default:
+        printk("failed in ioctl for incorrect input\n");
+        return -EINVAL;
     }
-    printk("ioctl was invoked successfully\n");
-    return SUCCESS;
+
+    if (status == SUCCESS)
+        printk("ioctl was invoked successfully\n");
+    return status;
+}
+
+static long device_ioctl(struct file* file, unsigned int ioctl_command_id, unsigned long ioctl_param) {
+    u64 start = latency_start();
+    long ret = __device_ioctl(file, ioctl_command_id, ioctl_param);
+    latency_record(file_message_slot(file), SLOT_OP_IOCTL, start);
+    return ret;
 }
 
 //==================== DEVICE SETUP =============================
@@ -353,18 +1881,158 @@ static long device_ioctl(struct file* file, unsigned int ioctl_command_id, unsig
 // when a process does something to the device we created
 struct file_operations Fops = {
         .owner	  = THIS_MODULE,
-        .read           = device_read,
-        .write          = device_write,
+        .read_iter      = device_read_iter,
+        .write_iter     = device_write_iter,
+        .splice_read    = device_splice_read,
+        .splice_write   = iter_file_splice_write,
         .open           = device_open,
         .unlocked_ioctl = device_ioctl,
         .release        = device_release,
 };
 
+//==================== CONTROL DEVICE ===========================
+// /dev/message_slot_control creates message_slots without device
+// nodes. Each of its ioctls returns a new fd bound straight to a
+// message_slot, which behaves like an fd of a minor's device node
+// but skips the open-time lookup. See message_slot.h.
+
+// an fd on an anonymous inode for m, taking over the caller's reference
+static int message_slot_fd(struct message_slot *m, __u32 flags) {
+    struct file_data *file_data;
+    int fd;
+
+    file_data = (struct file_data*) object_pool_alloc(&file_data_pool);
+    if (file_data == NULL) {
+        printk("failed allocating memory to create file_data\n");
+        put_message_slot(m);
+        return -ENOMEM;
+    }
+    file_data->message_slot = m;
+    file_data->current_channel = NULL;
+    file_data->read_header = false;
+    fd = anon_inode_getfd("[message_slot]", &Fops, file_data, O_RDWR | flags);
+    if (fd < 0) {
+        printk("failed creating fd for message_slot %lu\n", m->device_minor);
+        object_pool_free(&file_data_pool, file_data);
+        put_message_slot(m);
+    }
+    return fd;
+}
+
+// MSG_SLOT_DESTROY
+static long destroy_message_slot(unsigned long int slot_id) {
+    struct message_slot *m;
+    int rc;
+
+    mutex_lock(&message_slot_list_lock);
+    m = get_message_slot(slot_id);
+    if (m == NULL) {
+        mutex_unlock(&message_slot_list_lock);
+        return -ENOENT;
+    }
+    // without its destroy record the slot would come back at the next load
+    rc = journal_destroy(m);
+    if (rc != SUCCESS) {
+        mutex_unlock(&message_slot_list_lock);
+        return rc;
+    }
+    delete_message_slot_from_ptr(m);
+    mutex_unlock(&message_slot_list_lock);
+    printk("destroyed message_slot %lu\n", slot_id);
+    return SUCCESS;
+}
+
+// MSG_SLOT_CREATE and MSG_SLOT_OPEN
+static long control_open_slot(unsigned int ioctl_command_id, unsigned long ioctl_param) {
+    struct message_slot_create request;
+    struct message_slot *m;
+
+    if (copy_from_user(&request, (void __user *)ioctl_param, sizeof(request)) != 0) {
+        printk("failed reading message_slot request\n");
+        return -EFAULT;
+    }
+    if ((request.flags & ~O_CLOEXEC) != 0 || (request.slot_flags & ~MSG_SLOT_ARENA) != 0) {
+        printk("invalid flags for message_slot fd %u %u\n", request.flags, request.slot_flags);
+        return -EINVAL;
+    }
+
+    if (ioctl_command_id == MSG_SLOT_OPEN) {
+        mutex_lock(&message_slot_list_lock);
+        m = request.slot_id > ULONG_MAX ? NULL : get_message_slot(request.slot_id);
+        if (m != NULL)
+            kref_get(&m->refcount);
+        mutex_unlock(&message_slot_list_lock);
+        if (m == NULL)
+            return -ENOENT;
+        return message_slot_fd(m, request.flags);
+    }
+
+    m = create_anonymous_message_slot(request.slot_flags & MSG_SLOT_ARENA);
+    if (m == NULL)
+        return -ENOMEM;
+    request.slot_id = m->device_minor;
+    // report the id before there is an fd, which can't be taken back
+    if (copy_to_user((void __user *)ioctl_param, &request, sizeof(request)) != 0) {
+        printk("failed writing message_slot id\n");
+        put_message_slot(m);
+        destroy_message_slot(request.slot_id);
+        return -EFAULT;
+    }
+    return message_slot_fd(m, request.flags);
+}
+
+static long control_ioctl(struct file* file, unsigned int ioctl_command_id, unsigned long ioctl_param) {
+    switch (ioctl_command_id) {
+    case MSG_SLOT_CREATE:
+    case MSG_SLOT_OPEN:
+        return control_open_slot(ioctl_command_id, ioctl_param);
+    case MSG_SLOT_DESTROY:
+        return destroy_message_slot(ioctl_param);
+    default:
+        printk("failed in control ioctl for incorrect input\n");
+        return -EINVAL;
+    }
+}
+
+static const struct file_operations control_fops = {
+        .owner          = THIS_MODULE,
+        .unlocked_ioctl = control_ioctl,
+};
+
+static struct miscdevice control_device = {
+        .minor = MISC_DYNAMIC_MINOR,
+        .name  = CONTROL_DEVICE_NAME,
+        .fops  = &control_fops,
+};
+
 //---------------------------------------------------------------
 // Initialize the module - Register the character device
 static int __init simple_init(void)
 {
     int rc = -1;
+    unsigned int minor;
+    struct message_slot *m;
+
+    rc = init_object_pools();
+    if (rc != SUCCESS)
+        return rc;
+
+    debugfs_root = debugfs_create_dir(DEVICE_RANGE_NAME, NULL);
+    debugfs_create_file_unsafe("latency_enabled", 0600, debugfs_root, NULL, &latency_enabled_fops);
+
+    for (minor = 0; minor < prealloc_slots; ++minor) {
+        m = get_or_create_message_slot(minor);
+        if (m == NULL) {
+            rc = -ENOMEM;
+            goto fail;
+        }
+        put_message_slot(m);
+    }
+
+    // bring back what the journal remembers before anyone can open
+    rc = open_journal();
+    if (rc != SUCCESS)
+        goto fail;
 
     // Register driver capabilities. Obtain major num
     rc = register_chrdev( MAJOR_NUM, DEVICE_RANGE_NAME, &Fops );
@@ -373,15 +2041,26 @@ static int __init simple_init(void)
     if( rc < 0 ) {
         printk( KERN_ALERT "%s registration failed for %d\n",
                 DEVICE_FILE_NAME, MAJOR_NUM );
-        return rc;
+        goto fail;
     }
 
-    printk("Registration is successful. ");
+    rc = misc_register(&control_device);
+    if (rc != SUCCESS) {
+        printk( KERN_ALERT "%s registration failed\n", CONTROL_DEVICE_NAME );
+        unregister_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME);
+        goto fail;
+    }
 
-    // init message_slot list head
-    INIT_LIST_HEAD(&message_slot_list_head);
+    printk("Registration is successful. ");
 
     return 0;
+
+fail:
+    close_journal();
+    delete_all_message_slots();
+    debugfs_remove_recursive(debugfs_root);
+    destroy_object_pools();
+    return rc;
 }
 
 //---------------------------------------------------------------
@@ -389,9 +2068,13 @@ static void __exit simple_cleanup(void)
 {
     // Unregister the device
     // Should always succeed
+    misc_deregister(&control_device);
     unregister_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME);
+    close_journal();
     printk("deleting all message_slots in cleanup. ");
     delete_all_message_slots();
+    debugfs_remove_recursive(debugfs_root);
+    destroy_object_pools();
     printk("finished deleting all message_slots in cleanup. ");
 }
 
@@ -399,4 +2082,10 @@ static void __exit simple_cleanup(void)
 module_init(simple_init);
 module_exit(simple_cleanup);
 
+// the tests need the static helpers above, so they are built as part
+// of this file rather than as a separate object
+#if IS_ENABLED(CONFIG_MESSAGE_SLOT_KUNIT_TEST)
+#include "message_slot_test.c"
+#endif
+
 //========================= END OF FILE =========================
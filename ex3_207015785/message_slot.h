@@ -11,11 +11,101 @@
 //#define MAJOR_NUM 235
 #define MAJOR_NUM 235
 
+// Write one message to several channels of the same message_slot.
+// The message is stored once and shared by all the channels in
+// channel_ids; writing to one of them later does not affect the others.
+// Pointers are passed as __u64 so the layout is the same for 32 and
+// 64 bit processes.
+struct message_slot_broadcast {
+    __u64 channel_ids;    // user pointer to an array of __u64 channel ids
+    __u64 message;        // user pointer to the message
+    __u32 num_channels;
+    __u32 length;
+};
+
+// One channel as reported by MSG_SLOT_LIST_CHANNELS. Empty and
+// expired channels are reported with length, sequence and
+// write_time_ns all 0.
+struct message_slot_channel_info {
+    __u64 channel_id;
+    __u64 sequence;       // increases with every write to the message_slot
+    __u64 write_time_ns;  // CLOCK_REALTIME of the write that stored the message
+    __u32 length;
+    __u32 reserved;
+};
+
+// Enumerate the channels of a message_slot in increasing channel id
+// order, a batch per call. Start with cursor 0 and pass the returned
+// cursor back to continue; a returned cursor of 0 means the sweep is
+// done. Channels created or written during a sweep may or may not be
+// seen, but no channel existing for the whole sweep is missed or
+// reported twice.
+struct message_slot_list_channels {
+    __u64 cursor;         // in: first channel id to report, out: where to resume
+    __u64 channels;       // user pointer to max_channels message_slot_channel_info
+    __u32 max_channels;   // in
+    __u32 num_channels;   // out: how many were filled in
+};
+
+// What a read returns ahead of the message once MSG_SLOT_READ_HEADER
+// is set on the fd. write_time_ns is CLOCK_MONOTONIC, taken as the
+// message became visible to readers, so a reader on the same machine
+// gets the one-way latency from clock_gettime(CLOCK_MONOTONIC) minus
+// write_time_ns. write_time_ns and writer_pid are 0 for messages
+// restored from the journal.
+struct message_slot_header {
+    __u64 sequence;          // as in message_slot_channel_info
+    __u64 write_time_ns;     // CLOCK_MONOTONIC
+    __u64 write_realtime_ns; // CLOCK_REALTIME, same as message_slot_channel_info write_time_ns
+    __u32 writer_pid;        // process id of the writer in the reader's pid namespace, 0 if not visible there
+    __u32 length;            // of the message following the header
+};
+
+// For the ioctls of the control device, /dev/message_slot_control.
+// MSG_SLOT_CREATE makes a new message_slot with no device node and
+// fills in its slot_id; MSG_SLOT_OPEN opens the existing message_slot
+// slot_id, which may also be a minor that was opened before. Both
+// return a new fd for the message_slot, used exactly like an fd of a
+// device node. flags may only hold O_CLOEXEC. slot_flags only
+// matter to MSG_SLOT_CREATE: MSG_SLOT_ARENA packs the channels and
+// messages of the new message_slot into arenas of its own, which
+// makes writes cheaper and destroying a big message_slot fast.
+struct message_slot_create {
+    __u64 slot_id;        // out for MSG_SLOT_CREATE, in for MSG_SLOT_OPEN
+    __u32 flags;
+    __u32 slot_flags;
+};
+
+#define MSG_SLOT_ARENA 1
+
 // Set the channel of the device driver
 #define MSG_SLOT_CHANNEL _IOW(MAJOR_NUM, 0, unsigned int)
+// Broadcast a message, see struct message_slot_broadcast
+#define MSG_SLOT_BROADCAST _IOW(MAJOR_NUM, 1, struct message_slot_broadcast)
+// Set the time to live of messages in this message_slot, in
+// milliseconds. Expired messages read as absent (EWOULDBLOCK).
+// 0, the default, keeps messages until they are overwritten.
+#define MSG_SLOT_SET_TTL _IOW(MAJOR_NUM, 2, unsigned int)
+// List channels, see struct message_slot_list_channels
+#define MSG_SLOT_LIST_CHANNELS _IOWR(MAJOR_NUM, 3, struct message_slot_list_channels)
+// Prefix every read on this fd with a struct message_slot_header
+// (parameter 1) or go back to plain messages (0, the default). A
+// read then needs room for the header and the message, or fails
+// with ENOSPC as usual.
+#define MSG_SLOT_READ_HEADER _IOW(MAJOR_NUM, 7, unsigned int)
+// Control device: create a message_slot, see struct message_slot_create
+#define MSG_SLOT_CREATE _IOWR(MAJOR_NUM, 4, struct message_slot_create)
+// Control device: open an existing message_slot by id
+#define MSG_SLOT_OPEN _IOW(MAJOR_NUM, 5, struct message_slot_create)
+// Control device: destroy a message_slot, the parameter is its id.
+// fds still open on it keep working until closed, but the id is
+// free for reuse and the message_slot is gone for everyone else
+#define MSG_SLOT_DESTROY _IOW(MAJOR_NUM, 6, unsigned long)
 
 #define DEVICE_RANGE_NAME "message_slot"
+#define CONTROL_DEVICE_NAME "message_slot_control"
 #define MAX_MESSAGE_LENGTH 128
+#define MAX_BROADCAST_CHANNELS 1024
 #define DEVICE_FILE_NAME "slot"
 #define SUCCESS 0
 #define ERROR -1
@@ -0,0 +1,814 @@
+// KUnit tests and microbenchmarks for the message_slot core.
+//
+// This file is #included at the end of message_slot.c when
+// CONFIG_MESSAGE_SLOT_KUNIT_TEST is set, so it can call the static
+// helpers directly. Nothing here needs a /dev node or userspace.
+//
+// Running under User-Mode Linux, from a kernel source tree:
+//   1. copy (or symlink) this directory to drivers/char/message_slot
+//   2. add  source "drivers/char/message_slot/Kconfig"  to drivers/char/Kconfig
+//      and  obj-y += message_slot/                      to drivers/char/Makefile
+//   3. ./tools/testing/kunit/kunit.py run --kunitconfig=drivers/char/message_slot
+//
+// The benchmarks print their results with kunit_info(), so run with
+// --raw_output to see them. Against an installed kernel with KUnit
+// enabled as a module, "make KUNIT_TEST=1" builds the module with the
+// tests, which then run on insmod. Every case works on anonymous slots
+// of its own, and the suite skips itself when the module was already in
+// use as it started (a journal_path is set, or slots exist), so load it
+// without journal_path and prealloc_slots to run it.
+
+#include <kunit/test.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+
+#ifndef ITER_SOURCE
+#define ITER_SOURCE WRITE
+#define ITER_DEST   READ
+#endif
+
+#ifndef KUNIT_CASE_SLOW
+#define KUNIT_CASE_SLOW KUNIT_CASE
+#endif
+
+#define BENCH_CHANNELS 4096
+#define BENCH_ROUNDS 20000
+#define STRESS_THREADS 4
+#define STRESS_ROUNDS 20000
+
+//================== TEST HELPERS ===============================
+
+// a file as device_open would leave it, on the given minor
+static struct file *test_open(struct kunit *test, unsigned long int minor) {
+    struct file *file = kunit_kzalloc(test, sizeof(*file), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, file);
+    KUNIT_ASSERT_EQ(test, create_message_slot(minor, file), SUCCESS);
+    return file;
+}
+
+static void test_close(struct file *file) {
+    struct message_slot *m = file_message_slot(file);
+    object_pool_free(&file_data_pool, file->private_data);
+    file->private_data = NULL;
+    put_message_slot(m);
+}
+
+static long test_set_channel(struct file *file, unsigned long int channel_id) {
+    return set_channel((struct file_data *)file->private_data, channel_id);
+}
+
+static ssize_t test_write(struct file *file, const void *message, size_t length) {
+    struct kiocb iocb = { .ki_filp = file };
+    struct kvec kvec = { .iov_base = (void *)message, .iov_len = length };
+    struct iov_iter iter;
+    iov_iter_kvec(&iter, ITER_SOURCE, &kvec, 1, length);
+    return device_write_iter(&iocb, &iter);
+}
+
+static ssize_t test_read(struct file *file, void *buffer, size_t length) {
+    struct kiocb iocb = { .ki_filp = file };
+    struct kvec kvec = { .iov_base = buffer, .iov_len = length };
+    struct iov_iter iter;
+    iov_iter_kvec(&iter, ITER_DEST, &kvec, 1, length);
+    return device_read_iter(&iocb, &iter);
+}
+
+static void delete_test_slot(unsigned long int id) {
+    struct message_slot *m;
+    mutex_lock(&message_slot_list_lock);
+    m = get_message_slot(id);
+    if (m != NULL)
+        delete_message_slot_from_ptr(m);
+    mutex_unlock(&message_slot_list_lock);
+}
+
+// id of the slot every case starts with
+static unsigned long int test_slot(struct kunit *test) {
+    return ((struct message_slot *)test->priv)->device_minor;
+}
+
+// a second, empty anonymous slot kept alive by the index
+static unsigned long int test_other_slot(struct kunit *test) {
+    struct message_slot *m = create_anonymous_message_slot(false);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, m);
+    put_message_slot(m);
+    return m->device_minor;
+}
+
+// the cases delete and write slots freely, so they must not run next
+// to real users. whether the journal was open or any slot existed is
+// decided once, as the suite starts: slots a failed case leaves behind
+// must not turn the rest of the run into skips
+static bool message_slot_in_use;
+
+static int message_slot_suite_init(struct kunit_suite *suite) {
+    mutex_lock(&message_slot_list_lock);
+    message_slot_in_use = journal.file != NULL || !xa_empty(&message_slots);
+    mutex_unlock(&message_slot_list_lock);
+    return 0;
+}
+
+// the test keeps its own reference to its slot until message_slot_test_exit
+static int message_slot_test_init(struct kunit *test) {
+    if (message_slot_in_use)
+        kunit_skip(test, "message_slot is in use, load it without journal_path and prealloc_slots");
+
+    test->priv = create_anonymous_message_slot(false);
+    if (test->priv == NULL)
+        return -ENOMEM;
+    return 0;
+}
+
+// every anonymous slot was made by the suite, including any a failed
+// assert kept a case from deleting
+static void message_slot_test_exit(struct kunit *test) {
+    struct message_slot *m;
+    unsigned long int id;
+
+    if (test->priv == NULL)
+        return;
+    mutex_lock(&message_slot_list_lock);
+    xa_for_each(&message_slots, id, m) {
+        if (id >= FIRST_ANONYMOUS_SLOT)
+            delete_message_slot_from_ptr(m);
+    }
+    mutex_unlock(&message_slot_list_lock);
+    put_message_slot(test->priv);
+}
+
+//================== SLOTS AND CHANNELS =========================
+
+static void create_message_slot_test(struct kunit *test) {
+    struct message_slot *m = test->priv;
+    unsigned long int other_id = test_other_slot(test);
+    struct file *file = test_open(test, test_slot(test));
+    struct file *other = test_open(test, other_id);
+    struct file_data *file_data = file->private_data;
+
+    // opening an existing slot reuses it
+    KUNIT_EXPECT_PTR_EQ(test, file_data->message_slot, m);
+    KUNIT_EXPECT_PTR_EQ(test, file_data->current_channel, (struct channel *)NULL);
+
+    mutex_lock(&message_slot_list_lock);
+    KUNIT_EXPECT_PTR_EQ(test, get_message_slot(test_slot(test)), m);
+    KUNIT_EXPECT_PTR_EQ(test, get_message_slot(other_id),
+                        ((struct file_data *)other->private_data)->message_slot);
+    KUNIT_EXPECT_PTR_EQ(test, get_message_slot(other_id + 1), (struct message_slot *)NULL);
+    mutex_unlock(&message_slot_list_lock);
+
+    test_close(file);
+    test_close(other);
+    delete_test_slot(other_id);
+}
+
+static void create_channel_test(struct kunit *test) {
+    struct message_slot *m = test->priv;
+    struct channel *c1, *c2;
+
+    mutex_lock(&m->lock);
+    c1 = create_channel(1, m);
+    c2 = create_channel(ULONG_MAX, m);
+    KUNIT_EXPECT_NOT_ERR_OR_NULL(test, c1);
+    KUNIT_EXPECT_NOT_ERR_OR_NULL(test, c2);
+    KUNIT_EXPECT_PTR_EQ(test, get_channel_from_message_slot_ptr(1, m), c1);
+    KUNIT_EXPECT_PTR_EQ(test, get_channel_from_message_slot_ptr(ULONG_MAX, m), c2);
+    KUNIT_EXPECT_PTR_EQ(test, get_channel_from_message_slot_ptr(2, m), (struct channel *)NULL);
+    // get_or_create_channel must not create duplicates
+    KUNIT_EXPECT_PTR_EQ(test, get_or_create_channel(1, m), c1);
+    KUNIT_EXPECT_PTR_EQ(test, c1->message, (struct message_buffer *)NULL);
+    mutex_unlock(&m->lock);
+}
+
+static void anonymous_slot_test(struct kunit *test) {
+    struct message_slot *m = create_anonymous_message_slot(false);
+    struct file *file, *other;
+    char buffer[MAX_MESSAGE_LENGTH];
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, m);
+    KUNIT_EXPECT_GE(test, m->device_minor, FIRST_ANONYMOUS_SLOT);
+    mutex_lock(&message_slot_list_lock);
+    KUNIT_EXPECT_PTR_EQ(test, get_message_slot(m->device_minor), m);
+    mutex_unlock(&message_slot_list_lock);
+
+    // what MSG_SLOT_CREATE hands to its fd, and a second fd as from MSG_SLOT_OPEN
+    file = kunit_kzalloc(test, sizeof(*file), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, file);
+    file->private_data = object_pool_alloc(&file_data_pool);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, file->private_data);
+    ((struct file_data *)file->private_data)->message_slot = m;
+    ((struct file_data *)file->private_data)->current_channel = NULL;
+    ((struct file_data *)file->private_data)->read_header = false;
+    other = test_open(test, m->device_minor);
+
+    KUNIT_ASSERT_EQ(test, test_set_channel(file, 9), (long)SUCCESS);
+    KUNIT_ASSERT_EQ(test, test_write(file, "anon", 4), (ssize_t)4);
+    KUNIT_ASSERT_EQ(test, test_set_channel(other, 9), (long)SUCCESS);
+    KUNIT_EXPECT_EQ(test, test_read(other, buffer, sizeof(buffer)), (ssize_t)4);
+
+    // gone from the index, but the open files keep it alive
+    KUNIT_EXPECT_EQ(test, destroy_message_slot(m->device_minor), (long)SUCCESS);
+    KUNIT_EXPECT_EQ(test, destroy_message_slot(m->device_minor), (long)-ENOENT);
+    mutex_lock(&message_slot_list_lock);
+    KUNIT_EXPECT_PTR_EQ(test, get_message_slot(m->device_minor), (struct message_slot *)NULL);
+    mutex_unlock(&message_slot_list_lock);
+    KUNIT_EXPECT_EQ(test, test_write(file, "still", 5), (ssize_t)5);
+    KUNIT_EXPECT_EQ(test, test_read(other, buffer, sizeof(buffer)), (ssize_t)5);
+    KUNIT_EXPECT_EQ(test, kref_read(&m->refcount), 2U);
+
+    test_close(other);
+    test_close(file);
+}
+
+static void arena_test(struct kunit *test) {
+    struct message_slot *m = create_anonymous_message_slot(true);
+    struct file *file;
+    char buffer[MAX_MESSAGE_LENGTH];
+    unsigned int i, chunks, failed = 0;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, m);
+    KUNIT_EXPECT_TRUE(test, m->use_arena);
+    file = test_open(test, m->device_minor);
+    put_message_slot(m); // the file and the index hold it from here
+
+    // enough for several chunks of each arena
+    for (i = 1; i <= BENCH_CHANNELS; ++i) {
+        snprintf(buffer, sizeof(buffer), "message %u", i);
+        failed += test_set_channel(file, i) != SUCCESS;
+        failed += test_write(file, buffer, strlen(buffer)) != strlen(buffer);
+    }
+    KUNIT_EXPECT_EQ(test, failed, 0U);
+    KUNIT_EXPECT_EQ(test, m->channel_arena.in_use, (unsigned int)BENCH_CHANNELS);
+    KUNIT_EXPECT_EQ(test, m->message_arena.in_use, (unsigned int)BENCH_CHANNELS);
+    KUNIT_EXPECT_GT(test, m->message_arena.num_chunks, 1U);
+
+    // overwriting recycles the cells of the old messages
+    chunks = m->message_arena.num_chunks;
+    for (i = 1; i <= BENCH_CHANNELS; ++i) {
+        failed += test_set_channel(file, i) != SUCCESS;
+        failed += test_write(file, "again", 5) != 5;
+    }
+    KUNIT_EXPECT_EQ(test, failed, 0U);
+    KUNIT_EXPECT_EQ(test, m->message_arena.in_use, (unsigned int)BENCH_CHANNELS);
+    // at most one more, for the first new message before any old one was freed
+    KUNIT_EXPECT_LE(test, m->message_arena.num_chunks, chunks + 1);
+
+    KUNIT_ASSERT_EQ(test, test_set_channel(file, 77), (long)SUCCESS);
+    KUNIT_EXPECT_EQ(test, test_read(file, buffer, sizeof(buffer)), (ssize_t)5);
+    KUNIT_EXPECT_EQ(test, memcmp(buffer, "again", 5), 0);
+
+    KUNIT_EXPECT_EQ(test, destroy_message_slot(m->device_minor), (long)SUCCESS);
+    test_close(file);
+}
+
+#if IS_BUILTIN(CONFIG_MESSAGE_SLOT)
+// this drops every message_slot, so it only runs built into a test
+// kernel (UML), never against a loaded module somebody may be using
+static void delete_all_message_slots_test(struct kunit *test) {
+    struct file *file = test_open(test, test_other_slot(test));
+
+    KUNIT_ASSERT_EQ(test, test_set_channel(file, 5), (long)SUCCESS);
+    KUNIT_ASSERT_EQ(test, test_write(file, "bye", 3), (ssize_t)3);
+    test_close(file);
+
+    delete_all_message_slots();
+
+    mutex_lock(&message_slot_list_lock);
+    KUNIT_EXPECT_TRUE(test, xa_empty(&message_slots));
+    mutex_unlock(&message_slot_list_lock);
+}
+#endif
+
+static void object_pool_test(struct kunit *test) {
+    struct object_pool pool;
+    void *first, *second, *a, *b, *c;
+
+    KUNIT_ASSERT_EQ(test, init_object_pool(&pool, "message_slot_test_pool", 64, 2), SUCCESS);
+    KUNIT_EXPECT_EQ(test, pool.free, 2U);
+    first = pool.free_list;
+    second = *(void **)first;
+
+    // the preallocated objects go first, then the cache
+    a = object_pool_alloc(&pool);
+    b = object_pool_alloc(&pool);
+    KUNIT_EXPECT_PTR_EQ(test, a, first);
+    KUNIT_EXPECT_PTR_EQ(test, b, second);
+    KUNIT_EXPECT_EQ(test, pool.free, 0U);
+    c = object_pool_alloc(&pool);
+    KUNIT_EXPECT_NOT_ERR_OR_NULL(test, c);
+    KUNIT_EXPECT_EQ(test, pool.free, 0U);
+
+    // frees refill the reserve, and only up to its size
+    object_pool_free(&pool, c);
+    KUNIT_EXPECT_EQ(test, pool.free, 1U);
+    KUNIT_EXPECT_PTR_EQ(test, pool.free_list, c);
+    object_pool_free(&pool, a);
+    object_pool_free(&pool, b);
+    KUNIT_EXPECT_EQ(test, pool.free, 2U);
+    KUNIT_EXPECT_PTR_EQ(test, pool.free_list, a);
+    KUNIT_EXPECT_PTR_EQ(test, object_pool_alloc(&pool), a);
+    object_pool_free(&pool, a);
+    destroy_object_pool(&pool);
+
+    // without a reserve nothing is kept
+    KUNIT_ASSERT_EQ(test, init_object_pool(&pool, "message_slot_test_pool", 64, 0), SUCCESS);
+    a = object_pool_alloc(&pool);
+    KUNIT_EXPECT_NOT_ERR_OR_NULL(test, a);
+    object_pool_free(&pool, a);
+    KUNIT_EXPECT_EQ(test, pool.free, 0U);
+    KUNIT_EXPECT_PTR_EQ(test, pool.free_list, NULL);
+    destroy_object_pool(&pool);
+}
+
+//================== READ AND WRITE =============================
+
+static void read_write_test(struct kunit *test) {
+    struct file *file = test_open(test, test_slot(test));
+    char buffer[MAX_MESSAGE_LENGTH + 1];
+
+    // no channel set yet
+    KUNIT_EXPECT_EQ(test, test_write(file, "abcd", 4), (ssize_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, test_read(file, buffer, sizeof(buffer)), (ssize_t)-EINVAL);
+
+    KUNIT_ASSERT_EQ(test, test_set_channel(file, 6), (long)SUCCESS);
+    KUNIT_EXPECT_EQ(test, test_read(file, buffer, sizeof(buffer)), (ssize_t)-EWOULDBLOCK);
+
+    KUNIT_EXPECT_EQ(test, test_write(file, "Hello World!", 12), (ssize_t)12);
+    KUNIT_EXPECT_EQ(test, test_read(file, buffer, sizeof(buffer)), (ssize_t)12);
+    KUNIT_EXPECT_EQ(test, memcmp(buffer, "Hello World!", 12), 0);
+
+    // reading does not consume the message
+    KUNIT_EXPECT_EQ(test, test_read(file, buffer, sizeof(buffer)), (ssize_t)12);
+    KUNIT_EXPECT_EQ(test, test_read(file, buffer, 4), (ssize_t)-ENOSPC);
+
+    // overwrite, and failed writes keep the previous message
+    KUNIT_EXPECT_EQ(test, test_write(file, "new", 3), (ssize_t)3);
+    KUNIT_EXPECT_EQ(test, test_write(file, "", 0), (ssize_t)-EMSGSIZE);
+    memset(buffer, 'a', sizeof(buffer));
+    KUNIT_EXPECT_EQ(test, test_write(file, buffer, MAX_MESSAGE_LENGTH + 1), (ssize_t)-EMSGSIZE);
+    KUNIT_EXPECT_EQ(test, test_read(file, buffer, sizeof(buffer)), (ssize_t)3);
+    KUNIT_EXPECT_EQ(test, memcmp(buffer, "new", 3), 0);
+
+    KUNIT_EXPECT_EQ(test, test_write(file, buffer, MAX_MESSAGE_LENGTH), (ssize_t)MAX_MESSAGE_LENGTH);
+
+    test_close(file);
+}
+
+static void read_header_test(struct kunit *test) {
+    struct message_slot *m = test->priv;
+    struct file *file = test_open(test, test_slot(test));
+    struct file_data *file_data = file->private_data;
+    struct message_slot_header header;
+    char buffer[sizeof(header) + MAX_MESSAGE_LENGTH];
+    u64 before, after;
+
+    KUNIT_ASSERT_EQ(test, test_set_channel(file, 6), (long)SUCCESS);
+    before = ktime_get_ns();
+    KUNIT_ASSERT_EQ(test, test_write(file, "abc", 3), (ssize_t)3);
+    after = ktime_get_ns();
+
+    KUNIT_ASSERT_EQ(test, __device_ioctl(file, MSG_SLOT_READ_HEADER, 1), (long)SUCCESS);
+    KUNIT_EXPECT_TRUE(test, file_data->read_header);
+    KUNIT_ASSERT_EQ(test, test_read(file, buffer, sizeof(buffer)), (ssize_t)(sizeof(header) + 3));
+    memcpy(&header, buffer, sizeof(header));
+    KUNIT_EXPECT_EQ(test, header.sequence, m->write_seq);
+    KUNIT_EXPECT_GE(test, header.write_time_ns, before);
+    KUNIT_EXPECT_LE(test, header.write_time_ns, after);
+    KUNIT_EXPECT_EQ(test, header.writer_pid, (__u32)task_tgid_vnr(current));
+    KUNIT_EXPECT_EQ(test, header.length, 3U);
+    KUNIT_EXPECT_EQ(test, memcmp(buffer + sizeof(header), "abc", 3), 0);
+
+    // the header counts against the buffer
+    KUNIT_EXPECT_EQ(test, test_read(file, buffer, sizeof(header) + 2), (ssize_t)-ENOSPC);
+
+    KUNIT_ASSERT_EQ(test, __device_ioctl(file, MSG_SLOT_READ_HEADER, 0), (long)SUCCESS);
+    KUNIT_EXPECT_EQ(test, test_read(file, buffer, sizeof(buffer)), (ssize_t)3);
+
+    test_close(file);
+}
+
+static void channels_are_independent_test(struct kunit *test) {
+    struct file *a = test_open(test, test_slot(test));
+    struct file *b = test_open(test, test_slot(test));
+    char buffer[MAX_MESSAGE_LENGTH];
+
+    KUNIT_ASSERT_EQ(test, test_set_channel(a, 1), (long)SUCCESS);
+    KUNIT_ASSERT_EQ(test, test_set_channel(b, 2), (long)SUCCESS);
+    KUNIT_EXPECT_EQ(test, test_write(a, "one", 3), (ssize_t)3);
+    KUNIT_EXPECT_EQ(test, test_write(b, "two!", 4), (ssize_t)4);
+
+    // a second fd on the same channel sees the same message
+    KUNIT_ASSERT_EQ(test, test_set_channel(b, 1), (long)SUCCESS);
+    KUNIT_EXPECT_EQ(test, test_read(b, buffer, sizeof(buffer)), (ssize_t)3);
+    KUNIT_EXPECT_EQ(test, memcmp(buffer, "one", 3), 0);
+    KUNIT_ASSERT_EQ(test, test_set_channel(a, 2), (long)SUCCESS);
+    KUNIT_EXPECT_EQ(test, test_read(a, buffer, sizeof(buffer)), (ssize_t)4);
+
+    test_close(a);
+    test_close(b);
+}
+
+static void shared_message_test(struct kunit *test) {
+    struct message_slot *m = test->priv;
+    struct message_buffer *b = alloc_message_buffer(m, 6);
+    struct channel *c1, *c2;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, b);
+    memcpy(b->data, "shared", 6);
+
+    mutex_lock(&m->lock);
+    c1 = get_or_create_channel(10, m);
+    c2 = get_or_create_channel(11, m);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, c1);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, c2);
+    stamp_message(m, b);
+    set_channel_message(m, c1, b);
+    set_channel_message(m, c2, b);
+    mutex_unlock(&m->lock);
+
+    // one copy, three references: ours and one per channel
+    KUNIT_EXPECT_PTR_EQ(test, c1->message, b);
+    KUNIT_EXPECT_PTR_EQ(test, c2->message, b);
+    KUNIT_EXPECT_EQ(test, kref_read(&b->refcount), 3U);
+
+    // overwriting one channel leaves the other alone
+    mutex_lock(&m->lock);
+    set_channel_message(m, c1, NULL);
+    mutex_unlock(&m->lock);
+    KUNIT_EXPECT_PTR_EQ(test, c2->message, b);
+    KUNIT_EXPECT_EQ(test, kref_read(&b->refcount), 2U);
+
+    put_message_buffer(b);
+}
+
+static void list_channels_test(struct kunit *test) {
+    struct message_slot *m = test->priv;
+    struct file *file = test_open(test, test_slot(test));
+    struct message_slot_channel_info info[7];
+    unsigned long int channel_id = 0, expected = 3;
+    unsigned int n, i, seen = 0;
+    bool done = false;
+
+    // channels 3, 6, ..., 300, every other one holding a message
+    for (i = 100; i > 0; --i) {
+        KUNIT_ASSERT_EQ(test, test_set_channel(file, 3 * i), (long)SUCCESS);
+        if (i % 2 == 0)
+            KUNIT_ASSERT_EQ(test, test_write(file, "x", 1), (ssize_t)1);
+    }
+
+    while (!done) {
+        n = collect_channel_info(m, &channel_id, info, ARRAY_SIZE(info), &done);
+        for (i = 0; i < n; ++i, expected += 3) {
+            KUNIT_EXPECT_EQ(test, info[i].channel_id, (__u64)expected);
+            KUNIT_EXPECT_EQ(test, info[i].length, (__u32)(expected % 2 == 0 ? 1 : 0));
+            KUNIT_EXPECT_EQ(test, info[i].sequence != 0, expected % 2 == 0);
+        }
+        seen += n;
+    }
+    KUNIT_EXPECT_EQ(test, seen, 100U);
+
+    // resuming from the middle picks up exactly where asked
+    channel_id = 151;
+    n = collect_channel_info(m, &channel_id, info, 1, &done);
+    KUNIT_EXPECT_EQ(test, n, 1U);
+    KUNIT_EXPECT_EQ(test, info[0].channel_id, (__u64)153);
+    KUNIT_EXPECT_EQ(test, channel_id, 156UL);
+    KUNIT_EXPECT_FALSE(test, done);
+
+    test_close(file);
+}
+
+static void ttl_test(struct kunit *test) {
+    struct message_slot *m = test->priv;
+    struct file *file = test_open(test, test_slot(test));
+    struct channel *c;
+    char buffer[MAX_MESSAGE_LENGTH];
+
+    KUNIT_ASSERT_EQ(test, set_ttl(file->private_data, 1), (long)SUCCESS);
+    KUNIT_ASSERT_EQ(test, test_set_channel(file, 3), (long)SUCCESS);
+    KUNIT_EXPECT_EQ(test, test_write(file, "stale", 5), (ssize_t)5);
+
+    msleep(50);
+    KUNIT_EXPECT_EQ(test, test_read(file, buffer, sizeof(buffer)), (ssize_t)-EWOULDBLOCK);
+
+    // the reclaimer frees the expired message itself
+    flush_delayed_work(&m->reclaim_work);
+    c = ((struct file_data *)file->private_data)->current_channel;
+    KUNIT_EXPECT_PTR_EQ(test, c->message, (struct message_buffer *)NULL);
+    KUNIT_EXPECT_TRUE(test, list_empty(&m->expiry_list_head));
+
+    KUNIT_ASSERT_EQ(test, set_ttl(file->private_data, 0), (long)SUCCESS);
+    KUNIT_EXPECT_EQ(test, test_write(file, "fresh", 5), (ssize_t)5);
+    msleep(20);
+    KUNIT_EXPECT_EQ(test, test_read(file, buffer, sizeof(buffer)), (ssize_t)5);
+
+    test_close(file);
+}
+
+static void journal_replay_test(struct kunit *test) {
+    struct message_slot *m = test->priv;
+    struct file *file = test_open(test, test_slot(test));
+    struct journal_record r;
+    char buffer[MAX_MESSAGE_LENGTH];
+
+    memset(&r, 0, sizeof(r));
+    r.magic = JOURNAL_MAGIC;
+    r.device_minor = test_slot(test);
+    r.channel_id = 17;
+
+    // the newest record of a channel wins, whatever the order in the file
+    r.seq = 5;
+    r.length = 5;
+    KUNIT_EXPECT_EQ(test, journal_replay_record(&r, "newer"), SUCCESS);
+    r.seq = 3;
+    KUNIT_EXPECT_EQ(test, journal_replay_record(&r, "older"), SUCCESS);
+    KUNIT_EXPECT_EQ(test, m->write_seq, 5ULL);
+
+    KUNIT_ASSERT_EQ(test, test_set_channel(file, 17), (long)SUCCESS);
+    KUNIT_ASSERT_EQ(test, test_read(file, buffer, sizeof(buffer)), (ssize_t)5);
+    KUNIT_EXPECT_EQ(test, memcmp(buffer, "newer", 5), 0);
+
+    // new writes continue the replayed sequence
+    KUNIT_ASSERT_EQ(test, test_write(file, "next", 4), (ssize_t)4);
+    KUNIT_EXPECT_EQ(test, m->write_seq, 6ULL);
+
+    // a destroy record drops the slot again
+    r.device_minor = test_other_slot(test);
+    KUNIT_EXPECT_EQ(test, journal_replay_record(&r, "older"), SUCCESS);
+    r.channel_id = 0;
+    KUNIT_EXPECT_EQ(test, journal_replay_record(&r, "older"), -EINVAL);
+    r.length = 0;
+    KUNIT_EXPECT_EQ(test, journal_replay_record(&r, NULL), SUCCESS);
+    mutex_lock(&message_slot_list_lock);
+    KUNIT_EXPECT_PTR_EQ(test, get_message_slot(r.device_minor), (struct message_slot *)NULL);
+    mutex_unlock(&message_slot_list_lock);
+
+    test_close(file);
+}
+
+//================== LATENCY STATS ==============================
+
+static u64 latency_total(struct message_slot *m) {
+    u64 total = 0;
+    int cpu, op, bucket;
+    for_each_possible_cpu(cpu)
+        for (op = 0; op < NR_SLOT_OPS; ++op)
+            for (bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+                total += per_cpu_ptr(m->latency, cpu)->buckets[op][bucket];
+    return total;
+}
+
+static void latency_stats_test(struct kunit *test) {
+    struct message_slot *m = test->priv;
+    bool was_enabled = static_key_enabled(&latency_stats_enabled);
+    char output[512] = "";
+    struct seq_file s = { .buf = output, .size = sizeof(output) - 1, .private = m };
+    int cpu;
+
+    // off: nothing is recorded, whatever start says
+    latency_enabled_set(NULL, 0);
+    latency_record(m, SLOT_OP_WRITE, ktime_get_ns() - 1000);
+    KUNIT_EXPECT_EQ(test, latency_total(m), 0ULL);
+
+    // 1.5 * 2^20 ns lands in the bucket from 2^20 ns, with half a
+    // millisecond of slack for the time latency_record itself takes
+    latency_enabled_set(NULL, 1);
+    preempt_disable();
+    cpu = smp_processor_id();
+    latency_record(m, SLOT_OP_WRITE, ktime_get_ns() - (3ULL << 19));
+    preempt_enable();
+    KUNIT_EXPECT_EQ(test, per_cpu_ptr(m->latency, cpu)->buckets[SLOT_OP_WRITE][20], 1ULL);
+    KUNIT_EXPECT_EQ(test, latency_total(m), 1ULL);
+
+    KUNIT_EXPECT_EQ(test, latency_show(&s, NULL), 0);
+    output[s.count] = '\0';
+    KUNIT_EXPECT_STREQ(test, output, "op\tfrom_ns\tcount\nwrite\t1048576\t1\n");
+
+    KUNIT_EXPECT_EQ(test, latency_reset_set(m, 1), 0);
+    KUNIT_EXPECT_EQ(test, latency_total(m), 0ULL);
+
+    latency_enabled_set(NULL, was_enabled);
+}
+
+//================== CONCURRENCY ================================
+
+struct stress_worker {
+    struct kunit *test;
+    struct file *file;
+    int id;
+    atomic_t *errors;
+    struct completion done;
+};
+
+// writers store messages of length 16 + id filled with 'a' + id, so a
+// reader can check that every message it sees is whole
+static int stress_writer(void *data) {
+    struct stress_worker *w = data;
+    char message[16 + STRESS_THREADS];
+    int i;
+
+    memset(message, 'a' + w->id, sizeof(message));
+    for (i = 0; i < STRESS_ROUNDS; ++i) {
+        if (test_write(w->file, message, 16 + w->id) != 16 + w->id)
+            atomic_inc(w->errors);
+        if (i % 256 == 0)
+            cond_resched();
+    }
+    complete(&w->done);
+    return 0;
+}
+
+static int stress_reader(void *data) {
+    struct stress_worker *w = data;
+    char buffer[MAX_MESSAGE_LENGTH];
+    ssize_t length, j;
+    int i;
+
+    for (i = 0; i < STRESS_ROUNDS; ++i) {
+        length = test_read(w->file, buffer, sizeof(buffer));
+        if (length == -EWOULDBLOCK)
+            continue;
+        if (length < 16 || length >= 16 + STRESS_THREADS) {
+            atomic_inc(w->errors);
+            continue;
+        }
+        for (j = 0; j < length; ++j) {
+            if (buffer[j] != 'a' + (length - 16)) {
+                atomic_inc(w->errors);
+                break;
+            }
+        }
+        if (i % 256 == 0)
+            cond_resched();
+    }
+    complete(&w->done);
+    return 0;
+}
+
+static void concurrent_read_write_test(struct kunit *test) {
+    struct stress_worker *workers;
+    struct task_struct *task;
+    atomic_t errors = ATOMIC_INIT(0);
+    int i;
+
+    workers = kunit_kcalloc(test, 2 * STRESS_THREADS, sizeof(*workers), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, workers);
+
+    for (i = 0; i < 2 * STRESS_THREADS; ++i) {
+        struct stress_worker *w = &workers[i];
+        w->test = test;
+        w->id = i % STRESS_THREADS;
+        w->errors = &errors;
+        w->file = test_open(test, test_slot(test));
+        init_completion(&w->done);
+        // everybody on one channel, so every read races with writes
+        KUNIT_ASSERT_EQ(test, test_set_channel(w->file, 77), (long)SUCCESS);
+    }
+    for (i = 0; i < 2 * STRESS_THREADS; ++i) {
+        task = kthread_run(i < STRESS_THREADS ? stress_writer : stress_reader,
+                           &workers[i], "msg_slot_stress/%d", i);
+        KUNIT_ASSERT_FALSE(test, IS_ERR(task));
+    }
+    for (i = 0; i < 2 * STRESS_THREADS; ++i) {
+        wait_for_completion(&workers[i].done);
+        test_close(workers[i].file);
+    }
+
+    KUNIT_EXPECT_EQ(test, atomic_read(&errors), 0);
+}
+
+//================== MICROBENCHMARKS ============================
+
+// spread lookups over the channels instead of walking them in order
+static unsigned long int bench_channel_id(unsigned int i) {
+    return 1 + (i * 2654435761U) % BENCH_CHANNELS;
+}
+
+static void bench_report(struct kunit *test, const char *what, u64 start, unsigned int rounds) {
+    u64 elapsed = ktime_get_ns() - start;
+    kunit_info(test, "%s: %u ops in %llu us, %llu ns/op\n", what, rounds,
+               elapsed / 1000, elapsed / rounds);
+}
+
+static void lookup_benchmark(struct kunit *test) {
+    struct message_slot *m = test->priv;
+    unsigned int i, created = 0, found = 0;
+    u64 start;
+
+    // no asserts while holding the slot lock: a failed assert
+    // ends the test right there, lock and all
+    mutex_lock(&m->lock);
+    start = ktime_get_ns();
+    for (i = 1; i <= BENCH_CHANNELS; ++i)
+        created += create_channel(i, m) != NULL;
+    bench_report(test, "create_channel", start, BENCH_CHANNELS);
+
+    start = ktime_get_ns();
+    for (i = 0; i < BENCH_ROUNDS; ++i)
+        found += get_channel_from_message_slot_ptr(bench_channel_id(i), m) != NULL;
+    bench_report(test, "get_channel_from_message_slot_ptr", start, BENCH_ROUNDS);
+    mutex_unlock(&m->lock);
+
+    KUNIT_EXPECT_EQ(test, created, (unsigned int)BENCH_CHANNELS);
+    KUNIT_EXPECT_EQ(test, found, (unsigned int)BENCH_ROUNDS);
+}
+
+static void read_write_benchmark(struct kunit *test) {
+    struct file *file = test_open(test, test_slot(test));
+    char buffer[MAX_MESSAGE_LENGTH];
+    unsigned int i, failed = 0;
+    u64 start;
+
+    memset(buffer, 'x', sizeof(buffer));
+    // one fd switching between many channels, as a relay would
+    for (i = 1; i <= BENCH_CHANNELS; ++i)
+        KUNIT_ASSERT_EQ(test, test_set_channel(file, i), (long)SUCCESS);
+
+    start = ktime_get_ns();
+    for (i = 0; i < BENCH_ROUNDS; ++i) {
+        failed += test_set_channel(file, bench_channel_id(i)) != SUCCESS;
+        failed += test_write(file, buffer, sizeof(buffer)) != sizeof(buffer);
+    }
+    bench_report(test, "ioctl+write", start, BENCH_ROUNDS);
+
+    start = ktime_get_ns();
+    for (i = 0; i < BENCH_ROUNDS; ++i)
+        failed += test_write(file, buffer, sizeof(buffer)) != sizeof(buffer);
+    bench_report(test, "write", start, BENCH_ROUNDS);
+
+    start = ktime_get_ns();
+    for (i = 0; i < BENCH_ROUNDS; ++i)
+        failed += test_read(file, buffer, sizeof(buffer)) != sizeof(buffer);
+    bench_report(test, "read", start, BENCH_ROUNDS);
+
+    KUNIT_EXPECT_EQ(test, failed, 0U);
+    test_close(file);
+}
+
+// a slot with BENCH_CHANNELS channels holding a message, created
+// and destroyed through the control device paths. both modes walk
+// every channel on teardown (arena slots only to drop writer pids),
+// the cost is reported divided by the number of channels
+static void teardown_benchmark(struct kunit *test) {
+    struct message_slot *m;
+    struct file *file;
+    char buffer[MAX_MESSAGE_LENGTH];
+    unsigned int i, failed = 0;
+    int arena;
+    u64 start;
+
+    memset(buffer, 'x', sizeof(buffer));
+    for (arena = 0; arena <= 1; ++arena) {
+        m = create_anonymous_message_slot(arena);
+        KUNIT_ASSERT_NOT_ERR_OR_NULL(test, m);
+        file = test_open(test, m->device_minor);
+        put_message_slot(m);
+        for (i = 1; i <= BENCH_CHANNELS; ++i) {
+            failed += test_set_channel(file, i) != SUCCESS;
+            failed += test_write(file, buffer, sizeof(buffer)) != sizeof(buffer);
+        }
+        test_close(file);
+
+        // the index holds the last reference, so this frees the slot
+        start = ktime_get_ns();
+        failed += destroy_message_slot(m->device_minor) != SUCCESS;
+        bench_report(test, arena ? "teardown, arena" : "teardown, pools",
+                     start, BENCH_CHANNELS);
+    }
+    KUNIT_EXPECT_EQ(test, failed, 0U);
+}
+
+//================== SUITE ======================================
+
+static struct kunit_case message_slot_test_cases[] = {
+    KUNIT_CASE(create_message_slot_test),
+    KUNIT_CASE(create_channel_test),
+    KUNIT_CASE(anonymous_slot_test),
+    KUNIT_CASE(arena_test),
+    KUNIT_CASE(object_pool_test),
+    KUNIT_CASE(read_write_test),
+    KUNIT_CASE(read_header_test),
+    KUNIT_CASE(channels_are_independent_test),
+    KUNIT_CASE(shared_message_test),
+    KUNIT_CASE(list_channels_test),
+    KUNIT_CASE(ttl_test),
+    KUNIT_CASE(journal_replay_test),
+    KUNIT_CASE(latency_stats_test),
+#if IS_BUILTIN(CONFIG_MESSAGE_SLOT)
+    KUNIT_CASE(delete_all_message_slots_test),
+#endif
+    KUNIT_CASE_SLOW(concurrent_read_write_test),
+    KUNIT_CASE_SLOW(lookup_benchmark),
+    KUNIT_CASE_SLOW(read_write_benchmark),
+    KUNIT_CASE_SLOW(teardown_benchmark),
+    {}
+};
+
+static struct kunit_suite message_slot_test_suite = {
+    .name = "message_slot",
+    .suite_init = message_slot_suite_init,
+    .init = message_slot_test_init,
+    .exit = message_slot_test_exit,
+    .test_cases = message_slot_test_cases,
+};
+kunit_test_suite(message_slot_test_suite);